@@ -20,6 +20,9 @@ public:
 
     size_t getAccountCount() const;
 
+    // Caps the SQLite page cache, the default is about 2 MB per connection
+    bool setCacheSize(int kibibytes);
+
 private:
     sqlite3* db = nullptr;
     mutable std::mutex dbMutex;
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <array>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+
+class BufferPool;
+
+// Frame buffer borrowed from a BufferPool, goes back to the pool when destroyed
+class PooledBuffer {
+public:
+    PooledBuffer() = default;
+    PooledBuffer(BufferPool* pool, char* data, size_t capacity);
+    PooledBuffer(PooledBuffer&& other) noexcept;
+    PooledBuffer& operator=(PooledBuffer&& other) noexcept;
+    PooledBuffer(const PooledBuffer&) = delete;
+    PooledBuffer& operator=(const PooledBuffer&) = delete;
+    ~PooledBuffer();
+
+    char* data() { return bytes; }
+    const char* data() const { return bytes; }
+    size_t capacity() const { return cap; }
+
+private:
+    BufferPool* pool = nullptr;
+    char* bytes = nullptr;
+    size_t cap = 0;
+
+    void reset();
+};
+
+// Size-classed slab pool for frame buffers. Freed buffers are kept per size class
+// and handed out again, so steady traffic stops hitting the heap after warm-up.
+class BufferPool {
+public:
+    static constexpr std::array<size_t, 5> SIZE_CLASSES = {256, 1024, 4096, 16 * 1024, 64 * 1024};
+
+    struct Stats {
+        uint64_t acquires = 0;
+        uint64_t hits = 0;
+        size_t inUseBytes = 0;
+        size_t peakInUseBytes = 0;
+        size_t cachedBytes = 0;
+    };
+
+    explicit BufferPool(size_t maxCachedPerClass = 64);
+    ~BufferPool();
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    PooledBuffer acquire(size_t size);
+    // What acquire(size) takes from the cache or the heap
+    static size_t capacityFor(size_t size);
+    const Stats& stats() const { return counters; }
+
+    // Memory profile: cached buffers beyond the new limit are freed, preallocate()
+    // fills every class up to maxClassSize so the common frames never hit the heap
+    void setMaxCachedPerClass(size_t count);
+    void preallocate(size_t perClass, size_t maxClassSize);
+    size_t cacheLimitBytes() const;
+
+private:
+    friend class PooledBuffer;
+
+    size_t maxCachedPerClass;
+    std::array<std::vector<char*>, SIZE_CLASSES.size()> freeLists;
+    Stats counters;
+
+    void release(char* data, size_t capacity);
+    static int sizeClassFor(size_t size);
+};
+
+// Bump allocator for transient parsing data, reset once per event loop iteration.
+// Runs over into the heap when an iteration needs more than the fixed block.
+class FrameArena : public std::pmr::memory_resource {
+public:
+    explicit FrameArena(size_t capacity = 16 * 1024);
+    ~FrameArena() override;
+    FrameArena(const FrameArena&) = delete;
+    FrameArena& operator=(const FrameArena&) = delete;
+
+    void reset();
+    // Only between iterations, nothing may still point into the block
+    void resize(size_t newCapacity);
+
+    size_t capacityBytes() const { return capacity; }
+    size_t peakBytes() const { return peak; }
+    uint64_t overflowCount() const { return overflows; }
+
+private:
+    char* block;
+    size_t capacity;
+    size_t used = 0;
+    size_t peak = 0;
+    uint64_t overflows = 0;
+    std::vector<std::pair<void*, size_t>> overflowAllocations;
+
+    void* do_allocate(size_t bytes, size_t alignment) override;
+    void do_deallocate(void* p, size_t bytes, size_t alignment) override;
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override;
+};
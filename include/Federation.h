@@ -0,0 +1,158 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <cstdint>
+#include <ctime>
+#include <sys/socket.h>
+#include "FreiaEncryption.h"
+#include "UsernameTable.h"
+#include "MemoryBudget.h"
+
+// Links several server nodes into one chat. Nodes share the server password,
+// peer over authenticated TCP links and exchange presence and PROT1 frames.
+// PROT1 ciphertext is relayed as is, every node decrypts it with the same key.
+//
+// The handshake derives keys for the link from the server key, both nonces and
+// both node ids. Batches are encrypted with the link key and carry a sequence
+// number and an HMAC under the sender's MAC key, so a batch recorded on one link
+// can't be replayed, reordered or reflected, and nothing can be injected without the password.
+//
+// Peers form a full mesh: frames received from a peer are never forwarded to
+// another peer. Everything queued for a peer during one loop iteration goes
+// out as a single encrypted batch frame in flush().
+//
+// Links never block the server loop: connect, handshake and frames are driven
+// by socket readiness, a link that stays silent past its deadline is dropped.
+class Federation {
+public:
+    static constexpr uint32_t MAX_LINK_FRAME = 256 * 1024;
+    static constexpr size_t BATCH_BYTES = 64 * 1024;   // flush early once a batch gets this big
+
+    struct Config {
+        std::string nodeId;
+        int port = 0;                       // inter-node listen port, 0 to only dial out
+        std::vector<std::string> peers;     // "host:port" of nodes to dial
+        size_t maxRemoteUsers = 0;          // presence kept for all peers together, 0 is unlimited
+        size_t maxLinks = 0;                // links open at once, further peers wait or are refused, 0 is unlimited
+        size_t sendBufferBytes = 4 * MAX_LINK_FRAME;  // a peer that lets more pile up is dropped
+    };
+
+    struct Event {
+        enum Type { UserJoined, UserLeft, Chat };
+        Type type;
+        std::string username;
+        std::string frame;                  // Chat only: the PROT1 frame as the client sent it
+    };
+
+    struct WatchedSocket {
+        int fd = -1;
+        uint32_t id = 0;                    // changes when the fd is reused
+        bool wantsWrite = false;            // still connecting, or frames wait for socket room
+    };
+
+    static constexpr time_t RETRY_SECONDS = 2;
+    // What one remote user costs: its name in a peer's set and in the counted map, names are capped like local ones
+    static constexpr size_t REMOTE_USER_BYTES = MemoryBudget::entryBytes<std::unordered_set<std::string>>() +
+                                                MemoryBudget::entryBytes<std::unordered_map<std::string, int>>() +
+                                                2 * UsernameTable::MAX_LENGTH;
+    static constexpr time_t LINK_TIMEOUT_SECONDS = 5;  // for connect and handshake together
+
+    ~Federation();
+
+    // Worst case of config.maxLinks links with full buffers, see linkBytes in Federation.cpp
+    static size_t bufferBytes(const Config& config);
+    // A local user announced to the peers
+    static constexpr size_t localUserBytes() {
+        return MemoryBudget::entryBytes<decltype(localUsers)>() + UsernameTable::MAX_LENGTH;
+    }
+
+    bool start(const Config& config, const FreiaEncryption::Key& key);
+    bool enabled() const { return active; }
+
+    // Local presence, announced to every peer (again on each new link)
+    void userJoined(const std::string& username);
+    void userLeft(const std::string& username);
+    void publishChat(std::string_view frame);
+
+    // Sockets to watch for reading, some for writing too. Readiness is handed back with the id,
+    // a stale one (the link was replaced in the meantime) is ignored.
+    std::vector<WatchedSocket> watchedSockets() const;
+    void handleReady(int fd, uint32_t id, bool readable, bool writable);
+
+    // Redials peers that are down and drops links that did not come up in time,
+    // returns seconds until the next attempt or deadline, -1 when there is none
+    int maintain();
+    void flush();
+    void shutdown();
+
+    std::vector<Event> takeEvents();
+    // Users on other nodes -> number of links announcing them
+    const std::unordered_map<std::string, int>& remoteUsers() const { return remoteUserLinks; }
+
+private:
+    // Handshake waits for the peer's HELLO, Authenticating for its answer to our nonce
+    enum class LinkState { Down, Connecting, Handshake, Authenticating, Up };
+
+    struct Link {
+        int fd = -1;
+        uint32_t id = 0;
+        LinkState state = LinkState::Down;
+        std::string peerId;                 // node id, known once the peer's HELLO arrived
+        std::string address;                // "host:port" for links we dial, empty for accepted ones
+        sockaddr_storage peerAddress{};     // resolved once, the loop never waits for DNS
+        socklen_t peerAddressLength = 0;
+        bool dialed = false;
+        time_t nextAttempt = 0;
+        time_t deadline = 0;                // for connect and handshake
+        std::string nonce;                  // ours, part of the link keys
+        FreiaEncryption::Key linkKey{};     // encrypts batches, set from the peer's HELLO on
+        FreiaEncryption::Key sendMacKey{};  // authenticates what we send, the peer's receiveMacKey
+        FreiaEncryption::Key receiveMacKey{};
+        uint64_t sendSequence = 0;          // of the next batch each way
+        uint64_t receiveSequence = 0;
+        std::string outbox;                 // batch records not flushed yet
+        std::string sendBuffer;             // encrypted frames the socket had no room for
+        std::string receiveBuffer;          // start of a frame that is not complete yet
+        std::unordered_set<std::string> users;   // presence announced by this peer
+    };
+
+    bool active = false;
+    std::string nodeId;
+    FreiaEncryption::Key key{};
+    int listenFd = -1;
+    uint32_t nextLinkId = 0;
+    size_t maxRemoteUsers = 0;
+    size_t maxLinks = 0;
+    size_t sendBufferBytes = 0;
+    size_t remoteUserCount = 0;         // entries in all links' user sets
+    std::unordered_map<std::string, int> remoteUserLinks;
+    std::vector<Link> links;
+    std::unordered_map<std::string, int> localUsers;   // username -> connection count
+    std::vector<Event> events;
+
+    bool resolve(Link& link);
+    void dial(Link& link);
+    void openLink(Link& link, int fd);
+    size_t openLinks() const;
+    void acceptPeer();
+    bool sendHello(Link& link);
+    void deriveLinkKeys(Link& link, std::string_view peerNonce);
+    void readFrames(Link& link);
+    bool handleFrame(Link& link, std::string_view plaintext);
+    bool linkUp(Link& link);
+    bool coveredByLiveLink(const Link& link) const;
+    void dropLink(Link& link, const std::string& reason);
+    bool sendFrame(Link& link, std::string_view plaintext);
+    bool flushSendBuffer(Link& link);
+    bool sendBatch(Link& link);
+    void queue(Link& link, char type, std::string_view payload);
+    void queueAll(char type, std::string_view payload);
+    bool applyBatch(Link& link, std::string_view batch);
+    Link* findLink(int fd, uint32_t id);
+    bool addRemoteUser(const std::string& username);
+    bool removeRemoteUser(const std::string& username);
+};
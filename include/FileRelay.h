@@ -0,0 +1,86 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <optional>
+#include <unordered_map>
+#include <unordered_set>
+#include <cstdint>
+#include <ctime>
+#include "MemoryBudget.h"
+
+// Bookkeeping for PROT5 file transfers. The server never holds a file, only
+// the chunk being read and what a receiver's socket had no room for.
+// Flow control is a per-stream window: once the sender is more than
+// WINDOW_BYTES ahead of the slowest receiver's ACK its socket is not read.
+// The same happens while a receiver still has output queued.
+class FileRelay {
+public:
+    // File chunks skip the transport layer: [u32 CHUNK_FLAG | len][u32 stream id][u64 offset][E2EE bytes]
+    static constexpr uint32_t CHUNK_FLAG = 0x80000000;
+    static constexpr uint32_t CHUNK_HEADER_SIZE = 12;
+    static constexpr uint32_t MAX_CHUNK_SIZE = 64 * 1024;
+    static constexpr uint64_t WINDOW_BYTES = 256 * 1024;
+    static constexpr time_t MAX_IDLE_SECONDS = 10 * 60;
+
+    struct Receiver {
+        uint64_t nextOffset = 0;    // everything below was relayed
+        uint64_t ackedOffset = 0;   // everything below was confirmed by the receiver
+    };
+
+    struct Stream {
+        std::string owner;
+        uint64_t resumeSecret = 0;  // handed to the sender on OFFER, RESUME has to prove it
+        int senderSocket = -1;      // -1 while the sender is away, the stream can be resumed
+        uint64_t totalSize = 0;
+        uint64_t relayedOffset = 0;
+        std::unordered_map<int, Receiver> receivers;
+        time_t lastActivity = 0;
+        int pausing = -1;           // the sender this stream holds back, counted in pausedSenders
+    };
+
+    // Returns the stream's resume secret, nothing for ids in use and for sockets
+    // already at their stream limit (accept too)
+    std::optional<uint64_t> offer(uint32_t id, int senderSocket, const std::string& owner, uint64_t totalSize);
+    void setMaxStreamsPerSocket(size_t count) { maxStreamsPerSocket = count; }
+    // Streams whose sender dropped stay for a RESUME, beyond this many the least recently active go
+    void setMaxOrphanedStreams(size_t count) { maxOrphanedStreams = count; }
+
+    // Returns the offset the sender has to (re)start from
+    std::optional<uint64_t> accept(uint32_t id, int receiverSocket, uint64_t offset);
+    std::optional<uint64_t> resume(uint32_t id, int senderSocket, const std::string& owner, uint64_t secret);
+    void ack(uint32_t id, int receiverSocket, uint64_t offset);
+
+    // Receivers that still need [offset, offset + length), empty for unknown streams
+    std::vector<int> targetsFor(uint32_t id, int senderSocket, uint64_t offset, uint32_t length);
+
+    void removeReceiver(uint32_t id, int receiverSocket);
+    std::optional<Stream> close(uint32_t id, int senderSocket);
+    void dropSocket(int sock);
+    void expireIdle();
+
+    // A receiver with output waiting for socket room pauses every sender relaying to it
+    void setCongested(int receiverSocket, bool congested);
+
+    bool isPaused(int senderSocket) const { return pausedSenders.count(senderSocket) > 0; }
+    // What a socket adds besides its streams: its congestion mark and its paused stream count
+    static constexpr size_t socketBytes() {
+        return MemoryBudget::entryBytes<decltype(congestedReceivers)>() + MemoryBudget::entryBytes<decltype(pausedSenders)>();
+    }
+    const Stream* find(uint32_t id) const;
+
+private:
+    std::unordered_map<uint32_t, Stream> streams;
+    std::unordered_set<int> congestedReceivers;
+    // Sender socket -> number of its streams that are over the window or have a congested receiver.
+    // Kept up to date as streams change, the loop asks for every client on every iteration.
+    std::unordered_map<int, size_t> pausedSenders;
+    size_t maxStreamsPerSocket = 0;     // sending or receiving, 0 is unlimited
+    size_t maxOrphanedStreams = 0;      // 0 is unlimited
+
+    static uint64_t slowestAck(const Stream& stream);
+    void updatePause(Stream& stream);
+    void setPausing(Stream& stream, int senderSocket);
+    bool atStreamLimit(int sock, const std::string& owner = {}) const;
+    void dropExcessOrphans();
+};
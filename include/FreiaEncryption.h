@@ -1,5 +1,6 @@
 #pragma once
 #include <string>
+#include <string_view>
 #include <array>
 
 namespace FreiaEncryption
@@ -10,6 +11,10 @@ namespace FreiaEncryption
 
     std::string encryptData(const std::string& data, const Key& key);
     std::string decryptData(const std::string& data, const Key& key);
+    // Same as above but into a caller owned buffer, returns the bytes written or 0 on failure.
+    // Encryption needs data.size() + 32 bytes of room, decryption data.size().
+    size_t encryptInto(std::string_view data, const Key& key, char* out, size_t outCapacity);
+    size_t decryptInto(std::string_view data, const Key& key, char* out, size_t outCapacity);
     std::string base64_encode(const std::string& in);
     std::string base64_decode(const std::string& in);
     Key deriveKey(const std::string& password);
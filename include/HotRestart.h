@@ -0,0 +1,42 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <optional>
+#include "FreiaEncryption.h"
+
+// Hands a running server over to a freshly started binary without dropping clients.
+// The old process passes its listening socket and every client socket over a Unix
+// socket (SCM_RIGHTS), flushes its own state and exits.
+namespace HotRestart
+{
+    static const std::string socketPath = "freia-upgrade.sock";
+
+    struct ClientState {
+        int fd = -1;
+        int slot = -1;              // -1 with no username: the PROT2 handshake is not done yet
+        std::string username;
+        std::string pendingInput;   // bytes already read from the socket but not yet a full frame
+        std::string pendingOutput;  // bytes the client is owed before any new frame
+    };
+
+    struct State {
+        int port = 0;
+        int maxClients = 0;
+        FreiaEncryption::Key serverKey{};
+        std::string ticketKeys;     // raw SessionTickets keys
+        std::string redeemedTickets;    // SessionTickets::exportRedeemed()
+        int listenFd = -1;
+        std::vector<ClientState> clients;
+    };
+
+    // Old process side
+    int listenForUpgrade(const std::string& path);
+    int acceptUpgrade(int controlSocket);
+    // Succeeds only once the new process confirmed it took everything, the old one keeps serving otherwise
+    bool sendState(int conn, const State& state);
+    bool sendDone(int conn);
+
+    // New process side, blocks until the old process flushed everything
+    std::optional<State> receiveState(const std::string& path);
+}
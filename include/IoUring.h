@@ -0,0 +1,72 @@
+#pragma once
+
+#ifdef FREIA_HAVE_IO_URING
+
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <cstdint>
+#include <cstddef>
+
+// Thin wrapper around the raw io_uring syscalls (no liburing dependency).
+// Covers exactly what the server loop needs: multishot accept, multishot recv
+// into a provided buffer ring, linked sends and cancellation.
+class IoUring {
+public:
+    IoUring() = default;
+    ~IoUring();
+    IoUring(const IoUring&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
+
+    bool init(unsigned entries);
+    bool registerBufferRing(uint16_t groupId, unsigned count, unsigned bufferSize);
+
+    // All prep functions return false when the submission queue is full
+    bool prepAcceptMultishot(int listenFd, uint64_t userData);
+    bool prepRecvMultishot(int fd, uint64_t userData);
+    bool prepSend(int fd, const void* data, size_t length, uint64_t userData, bool linkNext);
+    bool prepCancel(uint64_t targetUserData, uint64_t userData);
+    bool prepPoll(int fd, uint64_t userData, unsigned events = POLLIN);
+    // timeout has to stay valid until submit()
+    bool prepTimeout(const __kernel_timespec* timeout, uint64_t userData);
+
+    // Submits everything queued and waits for at least waitFor completions
+    int submit(unsigned waitFor = 0);
+    unsigned freeSqes() const;
+
+    io_uring_cqe* peekCqe();
+    void seenCqe();
+
+    const char* buffer(uint16_t bufferId) const;
+    void recycleBuffer(uint16_t bufferId);
+
+private:
+    int ringFd = -1;
+    void* ringMem = nullptr;
+    size_t ringMemSize = 0;
+    io_uring_sqe* sqes = nullptr;
+    size_t sqesSize = 0;
+
+    unsigned* sqHead = nullptr;
+    unsigned* sqTail = nullptr;
+    unsigned* sqArray = nullptr;
+    unsigned sqMask = 0;
+    unsigned sqEntries = 0;
+    unsigned sqLocalTail = 0;
+
+    unsigned* cqHead = nullptr;
+    unsigned* cqTail = nullptr;
+    io_uring_cqe* cqes = nullptr;
+    unsigned cqMask = 0;
+
+    io_uring_buf* bufRing = nullptr;
+    size_t bufRingSize = 0;
+    char* bufMem = nullptr;
+    unsigned bufCount = 0;
+    unsigned bufSize = 0;
+    uint16_t bufGroup = 0;
+    uint16_t bufLocalTail = 0;
+
+    io_uring_sqe* getSqe();
+};
+
+#endif
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstddef>
+
+// Byte accounting against a global memory budget. Fixed costs (preallocated tables,
+// pools, SQLite cache) are charged once, every connection is charged its worst case
+// when it is admitted, so a full server stays inside the budget whatever clients send.
+// Only memory the server controls is counted, libraries and the binary are not.
+class MemoryBudget {
+public:
+    struct Profile {
+        size_t budgetBytes = 0;             // 0 is unlimited
+        int sqliteCacheKiB = 0;             // 0 keeps the SQLite default
+        size_t poolCachedPerClass = 64;
+        size_t poolPreallocatePerClass = 0; // buffers preallocated for each class up to 4K
+        size_t arenaBytes = 16 * 1024;
+        size_t streamsPerConnection = 0;    // concurrent PROT5 offers per sender, 0 is unlimited
+        size_t orphanedStreams = 1024;      // streams kept for senders that dropped, 0 is unlimited
+        size_t storedCursors = 65536;       // delivery cursors of offline users, 0 is unlimited
+        size_t remoteUsers = 65536;         // presence announced by federation peers, 0 is unlimited
+        size_t federationLinks = 16;        // peer links open at once, dialed and accepted, 0 is unlimited
+        size_t federationSendBuffer = 1024 * 1024;  // per link, a peer that leaves more unread is dropped
+        size_t redeemedTickets = 65536;     // used session tickets remembered until they expire, 0 is unlimited
+        size_t readBytes = 64 * 1024;       // one read of client input (select loop)
+        size_t maxChunkBytes = 64 * 1024;   // largest file chunk a client may send, at most FileRelay::MAX_CHUNK_SIZE
+        size_t maxHandshakeBytes = 65536;   // largest PROT2 handshake
+        size_t outboxBytes = 1024 * 1024;   // output a client may leave unread before it is dropped
+        bool allowIoUring = true;           // its buffer ring alone is 256K
+
+        // Sized for a Pi Zero: 1000 clients in 16 MB
+        static Profile lowMemory();
+    };
+
+    // A hash map entry is its value plus the next pointer and the cached hash, and a bucket
+    static constexpr size_t MAP_NODE_BYTES = 3 * sizeof(void*);
+    template <typename Map>
+    static constexpr size_t entryBytes() { return sizeof(typename Map::value_type) + MAP_NODE_BYTES; }
+    // A tree node is its value plus the color, the parent and two children
+    static constexpr size_t TREE_NODE_BYTES = 4 * sizeof(void*);
+    template <typename Tree>
+    static constexpr size_t treeEntryBytes() { return sizeof(typename Tree::value_type) + TREE_NODE_BYTES; }
+
+    void configure(const Profile& profile);
+    const Profile& profile() const { return config; }
+
+    void chargeFixed(const std::string& what, size_t bytes);
+    void setConnectionCost(size_t bytes) { connectionCost = bytes; }
+
+    // False when one more connection would not fit, forced admissions (hand-off) always count
+    bool admitConnection(bool force = false);
+    void releaseConnection();
+
+    size_t connections() const { return connectionCount; }
+    size_t fixedBytes() const { return fixed; }
+    size_t bytesPerConnection() const { return connectionCost; }
+    size_t usedBytes() const { return fixed + connectionCount * connectionCost; }
+    size_t connectionCapacity() const;
+
+    void report() const;
+
+private:
+    Profile config;
+    size_t fixed = 0;
+    size_t connectionCost = 0;
+    size_t connectionCount = 0;
+    std::vector<std::pair<std::string, size_t>> fixedItems;
+};
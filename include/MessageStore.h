@@ -0,0 +1,90 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <optional>
+#include <unordered_map>
+#include <cstdint>
+#include <ctime>
+
+// Append-only store for PROT1 frames, so users that were offline get what they missed.
+// Records are kept exactly as they go out on the wire ([u32 length][frame]) which lets
+// a backlog be streamed to a socket straight from the page cache.
+// Only the server-encrypted frame is stored, the inner ciphertext stays opaque.
+class MessageStore {
+public:
+    MessageStore(const std::string& dirPath = "freia_store",
+                 uint64_t segmentBytes = 4 * 1024 * 1024,
+                 uint64_t maxTotalBytes = 64 * 1024 * 1024,
+                 time_t maxAgeSeconds = 7 * 24 * 60 * 60);
+    ~MessageStore();
+
+    bool append(std::string_view frame);
+
+    // Global log position right after the last stored record
+    uint64_t endOffset() const;
+
+    // Cursor changes are appended to a log, the full file is only rewritten once the log gets long
+    void setCursor(const std::string& username, uint64_t offset);
+    std::optional<uint64_t> getCursor(const std::string& username) const;
+    // Beyond this many users the cursor furthest behind is forgotten, 0 is unlimited
+    void setMaxCursors(size_t count);
+
+    // Where a backlog delivery stands, the caller keeps one per connection
+    struct Delivery {
+        uint64_t offset = 0;        // next byte to send
+        uint64_t recordStart = 0;   // record that offset lies in while it is half sent
+        uint64_t recordEnd = 0;     // same as offset between records
+
+        bool midRecord() const { return offset != recordEnd; }
+        // Where the user continues after a disconnect, a half sent record goes again
+        uint64_t resumeOffset() const { return midRecord() ? recordStart : offset; }
+    };
+    enum class Progress { More, Done, Failed };
+
+    // Starts at the user's cursor, nothing for unknown users or users that are up to date
+    std::optional<Delivery> beginBacklog(const std::string& username);
+    // Sends up to maxBytes without blocking, the caller goes on once the socket is writable again.
+    // Records appended in the meantime are part of the backlog, it is Done at the end of the log.
+    Progress continueBacklog(int sock, Delivery& delivery, size_t maxBytes);
+    // The unsent bytes of a half sent record, handed to the next process on hot restart
+    std::optional<std::string> recordRest(const Delivery& delivery) const;
+
+    // Drops the oldest segments when the store is too big or too old, also run on a timer
+    void compact();
+
+    // Persists everything and stops writing, used before another process takes over the store
+    void flushAndClose();
+
+private:
+    struct Segment {
+        uint64_t baseOffset = 0;
+        uint64_t size = 0;
+        time_t lastWrite = 0;
+        std::string path;
+    };
+
+    std::string dir;
+    uint64_t segmentBytes;
+    uint64_t maxTotalBytes;
+    time_t maxAgeSeconds;
+
+    std::vector<Segment> segments;     // oldest first, last one is the active segment
+    int activeFd = -1;
+    bool closed = false;
+    std::unordered_map<std::string, uint64_t> cursors;
+    size_t maxCursors = 0;
+    int cursorLogFd = -1;
+    size_t cursorLogLines = 0;
+
+    bool openStore();
+    bool openActiveSegment(uint64_t baseOffset);
+    bool rollSegment();
+    uint64_t recoverSegment(const Segment& segment);
+    const Segment* segmentFor(uint64_t offset) const;
+    std::string segmentPath(uint64_t baseOffset) const;
+    void loadCursors();
+    void saveCursors();
+    bool trimCursors(const std::string& keep = {});
+};
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <optional>
+#include <array>
+#include <map>
+#include <unordered_set>
+#include <cstdint>
+#include <ctime>
+#include "MemoryBudget.h"
+
+// Session tickets let a client that logged in before skip PROT4 LOGIN on reconnect.
+// A ticket is base64([IV + AES-256-CBC ciphertext][HMAC-SHA256 over both]) of
+// "id\nusername\nexpiry\ncursor", so it can't be read or altered without the server's
+// ticket keys. Keys are random per server and survive a hot restart, tickets are single use.
+class SessionTickets {
+public:
+    static constexpr time_t LIFETIME_SECONDS = 24 * 60 * 60;
+    using Keys = std::array<unsigned char, 64>;     // 32 bytes AES key, 32 bytes HMAC key
+
+    struct Ticket {
+        std::string username;
+        uint64_t cursor = 0;        // where delivery to the user stood when the ticket was issued
+        time_t expires = 0;
+    };
+
+    SessionTickets();
+
+    const Keys& keys() const { return ticketKeys; }
+    void setKeys(const Keys& keys) { ticketKeys = keys; }
+
+    // Empty on failure
+    std::string issue(const std::string& username, uint64_t cursor);
+
+    // Checks MAC, expiry, owner and reuse, the ticket can't be redeemed a second time. A ticket
+    // presented for another username stays unused. While the maximum of remembered ids is
+    // reached no ticket is taken, clients log in instead.
+    std::optional<Ticket> redeem(std::string_view ticket, std::string_view username);
+    void setMaxRedeemed(size_t count) { maxRedeemed = count; }
+    static constexpr size_t redeemedEntryBytes() {
+        return MemoryBudget::entryBytes<decltype(redeemed)>() + MemoryBudget::treeEntryBytes<decltype(redeemedByExpiry)>();
+    }
+
+    // Ids of redeemed tickets that are still valid, one "id expiry" line each.
+    // Handed over on hot restart so a used ticket stays used in the new process.
+    std::string exportRedeemed() const;
+    void importRedeemed(std::string_view lines);
+
+private:
+    Keys ticketKeys{};
+    std::unordered_set<uint64_t> redeemed;          // ids of used tickets that have not expired yet
+    std::multimap<time_t, uint64_t> redeemedByExpiry;   // the same ids, the first to expire in front
+    size_t maxRedeemed = 0;                         // 0 is unlimited
+
+    void forgetExpired(time_t now);
+};
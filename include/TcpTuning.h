@@ -0,0 +1,56 @@
+#pragma once
+
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+#include "MemoryBudget.h"
+
+// Socket options for client connections plus write coalescing for bursts.
+//
+// Latency mode turns Nagle off so every frame leaves right away. Throughput mode
+// keeps Nagle and corks a socket as soon as it gets a second frame within one loop
+// iteration (join/leave pairs, user lists, backlog), flush() sends the burst as
+// full segments at the end of the iteration.
+class TcpTuning {
+public:
+    enum class Mode { Latency, Throughput };
+
+    struct Policy {
+        Mode mode = Mode::Latency;
+        int sendBufferBytes = 0;            // 0 keeps the kernel's autotuning
+        int receiveBufferBytes = 0;
+        unsigned userTimeoutMs = 30000;     // drop connections whose data stays unacked this long, 0 is off
+        int keepAliveIdleSeconds = 60;      // 0 turns keepalive off
+        int keepAliveIntervalSeconds = 10;
+        int keepAliveCount = 5;
+    };
+
+    struct Stats {
+        uint64_t corkedBursts = 0;
+        uint64_t coalescedFrames = 0;       // frames that went out as part of a corked burst
+    };
+
+    void setPolicy(const Policy& newPolicy) { policy = newPolicy; }
+    const Policy& currentPolicy() const { return policy; }
+    const Stats& stats() const { return counters; }
+
+    // Buffer sizes have to be on the listener before the handshake to get the right window scale
+    void applyToListener(int fd) const;
+    void applyToClient(int fd) const;
+
+    // Call before every frame sent to fd
+    void beforeWrite(int fd);
+    void forget(int fd);
+    void flush();
+
+    // A socket's write count and its place in corked, which grows by doubling
+    static constexpr size_t socketBytes() {
+        return MemoryBudget::entryBytes<decltype(writesThisIteration)>() + 2 * sizeof(int);
+    }
+
+private:
+    Policy policy;
+    Stats counters;
+    std::unordered_map<int, unsigned> writesThisIteration;
+    std::vector<int> corked;
+};
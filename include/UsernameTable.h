@@ -0,0 +1,38 @@
+#pragma once
+
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+#include <cstddef>
+
+// Interned usernames in fixed-size entries allocated once up front. A name that is
+// connected several times is stored once, callers keep 32 bit ids instead of copies.
+class UsernameTable {
+public:
+    static constexpr size_t MAX_LENGTH = 64;
+    static constexpr uint32_t NONE = 0;
+
+    explicit UsernameTable(size_t capacity = 0);
+    void reserve(size_t capacity);
+
+    // Returns NONE when the name is too long or every entry is taken
+    uint32_t intern(std::string_view name);
+    void release(uint32_t id);
+    std::string_view name(uint32_t id) const;
+    bool contains(std::string_view name) const { return index.count(name) > 0; }
+
+    size_t size() const { return index.size(); }
+    size_t bytes() const;
+
+private:
+    struct Entry {
+        char text[MAX_LENGTH];
+        uint8_t length = 0;
+        uint32_t refs = 0;
+    };
+
+    std::vector<Entry> entries;                 // id - 1 indexes this, never reallocated after reserve()
+    std::vector<uint32_t> freeIds;
+    std::unordered_map<std::string_view, uint32_t> index;   // keys point into entries
+};
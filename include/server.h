@@ -14,11 +14,32 @@
 #include "FreiaEncryption.h"
 #include <mutex>
 #include <unordered_map>
+#include <deque>
 #include "AccountDatabase.h"
+#include "MessageStore.h"
+#include "FileRelay.h"
+#include "BufferPool.h"
+#include "IoUring.h"
+#include "HotRestart.h"
+#include "Federation.h"
+#include "TcpTuning.h"
+#include "UsernameTable.h"
+#include "MemoryBudget.h"
+#include "SessionTickets.h"
+#include <memory>
+#include <optional>
+#include <string_view>
+#include <memory_resource>
 
 class Server {
 public:
-    Server(int port, int maxClients, const std::string& password);
+    // dataDir prefixes the account database, message store and upgrade socket ("" is the cwd)
+    Server(int port, int maxClients, const std::string& password, bool useIoUring = false,
+           const std::string& dataDir = "");
+    Server(const HotRestart::State& state, bool useIoUring = false, const std::string& dataDir = "");
+    void enableFederation(const Federation::Config& config);
+    void setTcpPolicy(const TcpTuning::Policy& policy);
+    void setMemoryProfile(const MemoryBudget::Profile& profile);
     void run();
 
 private:
@@ -28,16 +49,48 @@ private:
     void collectActiveClientSockets();
     void waitForServerActivity();
     void connectNewClientSocket();
+    bool admitClient(int newSocket);
+    int authenticateClient(int newSocket, std::string_view encrypted);
+    void dropHandshake(int sock, const std::string& reason);
+    void expireHandshakes();
     void handleClientActivity();
-    std::vector<std::string> splitByNewline(const std::string& s);
-    void processProt1(int clientIndex, const std::string& encrypted, const std::string& plaintext);
+    void readClientInput(int fd);
+    void drainInbox(int fd);
+    std::optional<size_t> processInput(int fd, std::string_view input);
+    std::string pendingInputOf(int fd) const;
+    void processFrame(int clientIndex, std::string_view encrypted);
+    std::pmr::vector<std::string_view> splitByNewline(std::string_view s);
+    void processProt1(int clientIndex, std::string_view encrypted, std::string_view plaintext);
     void disconnectClient(int index, const std::string& reason = "Unknown");
     void sendFullUserList(int targetSocket);
     void broadcastProt3(const std::string& messageText, const std::string& messageType, int onlyTo = -1); // -1 is broadcast to all 
-    void processProt4(int clientIndex, const std::string& plaintext);
+    void processProt4(int clientIndex, std::string_view plaintext);
     void sendSuccess(int sock, const std::string& msg);
     void sendError(int sock, const std::string& reason);
-    bool sendWithLengthPrefix(int sock, const std::string& data);
+    bool sendWithLengthPrefix(int sock, std::string_view data, uint32_t prefixFlags = 0);
+    std::pmr::vector<int> fanOut(const int* targets, size_t count, std::string_view data, uint32_t prefixFlags = 0);
+    bool sendEncrypted(int sock, std::string_view frame);
+    void processProt5(int clientIndex, std::string_view plaintext);
+    void sendProt5(int sock, const std::string& frame);
+    void relayFileChunk(int clientIndex, std::string_view chunk);
+    void runSelect();
+    void handOff();
+    void restoreHandoffInput();
+    void logMemoryStats();
+    std::string_view usernameOf(int slot) const;
+    std::string ipOf(const sockaddr_in& addr) const;
+    void pumpFederation();
+    void handleFederationEvents();
+    void continueBacklog(int sock, size_t maxBytes);
+    // Store position everything before which the socket's user has been sent
+    uint64_t deliveryCursor(int sock) const;
+    bool hasPendingOutput(int sock) const;
+    void queueOutput(int sock, std::string_view head, std::string_view data, bool first = false);
+    bool flushOutbox(int sock);
+    void handleWritable(int sock);
+    void dropFailedSockets();
+    int secondsUntilTimer() const;
+    void runMaintenance();
 
 
 
@@ -52,15 +105,140 @@ private:
     int activity = 0;
     int max_socket = -1;
     fd_set readfds;
+    fd_set writefds;
     int addrlen = 0;
     sockaddr_in address{};
     static constexpr int MAX_PACKET_SIZE = 1024;
     char buffer[MAX_PACKET_SIZE];
     int masterSocket = -1;
 
-    std::unordered_map<int, std::string> socketToUsername;
+    // Accepted sockets that have not sent their PROT2 handshake yet -> deadline. They are charged
+    // to the memory budget from the accept on, so a flood of them can't outgrow it either.
+    std::unordered_map<int, time_t> handshakes;
+    static constexpr time_t HANDSHAKE_TIMEOUT_SECONDS = 10;
+
+    // Per slot like clientSocket, the names themselves live in the interning table
+    std::vector<uint32_t> clientUsername;
+    UsernameTable usernames;
 
     std::mutex socketMutex;
 
     AccountDatabase accountsDb;
+
+    MessageStore offlineStore;
+    // Backlogs still being streamed, by socket. They only go out while the socket is writable
+    // and live PROT1 frames wait in the store until the client has caught up.
+    std::unordered_map<int, MessageStore::Delivery> backlogs;
+    static constexpr size_t BACKLOG_SLICE_BYTES = 64 * 1024;
+
+    // Store compaction and other housekeeping that must not depend on traffic
+    static constexpr time_t MAINTENANCE_SECONDS = 60;
+    time_t nextMaintenance = 0;
+
+    FileRelay fileRelay;
+
+    static constexpr uint64_t STATS_INTERVAL = 10000;
+    BufferPool framePool;
+    FrameArena frameArena;
+    MemoryBudget memoryBudget;
+    size_t baselineRssBytes = 0;
+
+    // Bytes read from a client but not yet a complete frame (select loop, io_uring keeps them per
+    // IoUringConnection). File chunks are complete before a receiver gets any of them. A paused
+    // sender is not read, so an inbox stays below one frame plus one read.
+    std::unordered_map<int, std::string> inboxes;
+
+    // Client input and output limits, from the memory profile (see setMemoryProfile)
+    size_t readBytes = 64 * 1024;
+    uint32_t maxChunkBytes = FileRelay::MAX_CHUNK_SIZE;
+    uint32_t maxHandshakeBytes = 65536;
+    size_t outboxLimitBytes = 1024 * 1024;
+    size_t maxFrameBytes() const;       // the largest frame a client may send, length prefix included
+
+    // Frames a socket had no room for, sent in order once it is writable. Anything else for
+    // that socket queues up behind them and file senders relaying to it are paused.
+    struct PendingFrame {
+        PooledBuffer data;
+        size_t length = 0;
+        size_t sent = 0;
+    };
+    struct Outbox {
+        std::deque<PendingFrame> frames;
+        size_t bytes = 0;           // still to send
+        size_t heldBytes = 0;       // pooled buffers and entries of the frames, outboxLimitBytes applies to it
+        bool failed = false;        // nothing is queued anymore, the client is being dropped
+    };
+    std::unordered_map<int, Outbox> outboxes;
+    static constexpr size_t OUTBOX_BUFFER_BYTES = 1024;    // smallest buffer taken for queued frames
+    std::vector<int> failedSockets;     // dropped at the end of the loop iteration
+
+    bool useIoUring;
+
+    // Socket options and burst corking for client connections
+    TcpTuning tcpTuning;
+
+    // Resumption tickets handed out after PROT4 LOGIN, see SessionTickets.h
+    SessionTickets tickets;
+
+    // Other nodes of the chat, see Federation.h
+    Federation federation;
+    int federationRetry = -1;   // seconds until the next redial or link deadline, -1 when there is none
+
+    // Hot restart, a new binary connects here to take over the sockets
+    int upgradeSocket = -1;
+    bool handedOff = false;
+#ifdef FREIA_HAVE_IO_URING
+    // io_uring backend, see server_io_uring.cpp
+    struct IoUringConnection {
+        uint32_t generation = 0;    // tags completions, stale ones belong to an earlier use of the fd
+        bool open = true;
+        bool recvArmed = false;
+        bool cancelRequested = false;
+        bool writablePollArmed = false;
+        bool sendInFlight = false;  // frames for it queue in the outbox until the send completed
+        std::string inbox;          // bytes received but not yet parsed into frames
+    };
+
+    // Linked prefix + payload sends the kernel still works on, by ringSendKey. The loop does not
+    // wait for them: whatever a send did not get out goes to the front of the socket's outbox.
+    // The payload is shared by all targets of a fan-out and freed with the last completion.
+    struct RingSend {
+        std::shared_ptr<PooledBuffer> payload;
+        size_t payloadLength = 0;
+        uint32_t prefixNet = 0;         // the kernel reads it from here, map nodes do not move
+        int prefixResult = 0;
+        int payloadResult = 0;
+        int outstanding = 2;
+    };
+    std::unordered_map<uint64_t, RingSend> ringSends;
+
+    static constexpr unsigned RING_ENTRIES = 256;
+    static constexpr unsigned RECV_BUFFER_COUNT = 64;
+    static constexpr unsigned RECV_BUFFER_SIZE = 4096;
+    // Unparsed input per connection is a partial frame plus what a paused sender's recv
+    // can still deliver (one buffer ring) before its cancellation lands
+    static constexpr size_t RING_READ_BYTES = RECV_BUFFER_COUNT * RECV_BUFFER_SIZE;
+
+    std::unique_ptr<IoUring> ring;
+    std::unordered_map<int, IoUringConnection> ringConnections;
+    std::deque<io_uring_cqe> deferredCqes;      // reaped while waiting for sends, handled in order later
+    uint32_t nextRingGeneration = 0;
+    std::unordered_map<int, uint32_t> federationPolls;       // peer link fd -> link id of the armed read poll
+    std::unordered_map<int, uint32_t> federationWritePolls;  // same for links waiting to connect or to send
+    __kernel_timespec loopTimer{};
+    time_t loopTimerDeadline = 0;       // of the earliest armed timeout, 0 when none is
+
+    bool runIoUring();
+    void handleIoUringCompletion(const io_uring_cqe& cqe);
+    void armIoUringAccept();
+    void armIoUringRecv(int fd);
+    void acceptIoUringClient(int fd, bool armRecv);
+    void drainIoUringInbox(int fd);
+    void finishIoUringSend(const io_uring_cqe& cqe);
+    void retireIoUringConnection(int fd);
+    void quiesceIoUring();
+    void armIoUringFederation();
+    void armIoUringTimer();
+    std::pmr::vector<int> fanOutIoUring(const int* targets, size_t count, std::string_view data, uint32_t prefixFlags);
+#endif
 };
@@ -10,6 +10,8 @@ AccountDatabase::AccountDatabase(const std::string& dbPath) {
         return;
     }
 
+    // On hot restart the old process may still be checkpointing while this one opens the file
+    sqlite3_busy_timeout(db, 5000);
     sqlite3_exec(db, "PRAGMA journal_mode=WAL;", nullptr, nullptr, nullptr);
 
     if (!initializeSchema()) {
@@ -23,6 +25,12 @@ AccountDatabase::~AccountDatabase() {
     if (db) sqlite3_close(db);
 }
 
+bool AccountDatabase::setCacheSize(int kibibytes) {
+    if (!db) return false;
+    // Negative values are KiB instead of pages
+    return execute("PRAGMA cache_size=-" + std::to_string(kibibytes) + ";");
+}
+
 bool AccountDatabase::initializeSchema() {
     const char* createTable = 
         "CREATE TABLE IF NOT EXISTS accounts ("
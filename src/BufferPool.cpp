@@ -0,0 +1,166 @@
+#include "BufferPool.h"
+#include <algorithm>
+#include <new>
+
+PooledBuffer::PooledBuffer(BufferPool* pool, char* data, size_t capacity)
+    : pool(pool), bytes(data), cap(capacity) {}
+
+PooledBuffer::PooledBuffer(PooledBuffer&& other) noexcept
+    : pool(other.pool), bytes(other.bytes), cap(other.cap) {
+    other.pool = nullptr;
+    other.bytes = nullptr;
+    other.cap = 0;
+}
+
+PooledBuffer& PooledBuffer::operator=(PooledBuffer&& other) noexcept {
+    if (this != &other) {
+        reset();
+        pool = other.pool;
+        bytes = other.bytes;
+        cap = other.cap;
+        other.pool = nullptr;
+        other.bytes = nullptr;
+        other.cap = 0;
+    }
+    return *this;
+}
+
+PooledBuffer::~PooledBuffer() {
+    reset();
+}
+
+void PooledBuffer::reset() {
+    if (pool && bytes) pool->release(bytes, cap);
+    pool = nullptr;
+    bytes = nullptr;
+    cap = 0;
+}
+
+BufferPool::BufferPool(size_t maxCachedPerClass) : maxCachedPerClass(maxCachedPerClass) {}
+
+BufferPool::~BufferPool() {
+    for (auto& freeList : freeLists) {
+        for (char* data : freeList) delete[] data;
+    }
+}
+
+int BufferPool::sizeClassFor(size_t size) {
+    for (size_t i = 0; i < SIZE_CLASSES.size(); ++i) {
+        if (size <= SIZE_CLASSES[i]) return static_cast<int>(i);
+    }
+    return -1;
+}
+
+size_t BufferPool::capacityFor(size_t size) {
+    int sizeClass = sizeClassFor(size);
+    return sizeClass < 0 ? size : SIZE_CLASSES[sizeClass];
+}
+
+PooledBuffer BufferPool::acquire(size_t size) {
+    counters.acquires++;
+
+    int sizeClass = sizeClassFor(size);
+    size_t capacity = sizeClass < 0 ? size : SIZE_CLASSES[sizeClass];
+    char* data = nullptr;
+
+    if (sizeClass >= 0 && !freeLists[sizeClass].empty()) {
+        data = freeLists[sizeClass].back();
+        freeLists[sizeClass].pop_back();
+        counters.hits++;
+        counters.cachedBytes -= capacity;
+    } else {
+        data = new char[capacity];
+    }
+
+    counters.inUseBytes += capacity;
+    counters.peakInUseBytes = std::max(counters.peakInUseBytes, counters.inUseBytes);
+    return PooledBuffer(this, data, capacity);
+}
+
+void BufferPool::release(char* data, size_t capacity) {
+    counters.inUseBytes -= capacity;
+
+    // Oversized buffers and anything beyond the per-class cache go back to the heap
+    int sizeClass = sizeClassFor(capacity);
+    if (sizeClass < 0 || SIZE_CLASSES[sizeClass] != capacity ||
+        freeLists[sizeClass].size() >= maxCachedPerClass) {
+        delete[] data;
+        return;
+    }
+
+    freeLists[sizeClass].push_back(data);
+    counters.cachedBytes += capacity;
+}
+
+void BufferPool::setMaxCachedPerClass(size_t count) {
+    maxCachedPerClass = count;
+    for (size_t i = 0; i < SIZE_CLASSES.size(); ++i) {
+        while (freeLists[i].size() > maxCachedPerClass) {
+            delete[] freeLists[i].back();
+            freeLists[i].pop_back();
+            counters.cachedBytes -= SIZE_CLASSES[i];
+        }
+    }
+}
+
+void BufferPool::preallocate(size_t perClass, size_t maxClassSize) {
+    for (size_t i = 0; i < SIZE_CLASSES.size() && SIZE_CLASSES[i] <= maxClassSize; ++i) {
+        size_t target = std::min(perClass, maxCachedPerClass);
+        freeLists[i].reserve(maxCachedPerClass);
+        while (freeLists[i].size() < target) {
+            freeLists[i].push_back(new char[SIZE_CLASSES[i]]);
+            counters.cachedBytes += SIZE_CLASSES[i];
+        }
+    }
+}
+
+size_t BufferPool::cacheLimitBytes() const {
+    size_t bytes = 0;
+    for (size_t size : SIZE_CLASSES) bytes += size * maxCachedPerClass;
+    return bytes;
+}
+
+FrameArena::FrameArena(size_t capacity) : block(new char[capacity]), capacity(capacity) {}
+
+FrameArena::~FrameArena() {
+    reset();
+    delete[] block;
+}
+
+void FrameArena::reset() {
+    for (auto& [p, bytes] : overflowAllocations) {
+        ::operator delete(p, bytes);
+    }
+    overflowAllocations.clear();
+    used = 0;
+}
+
+void FrameArena::resize(size_t newCapacity) {
+    reset();
+    delete[] block;
+    block = new char[newCapacity];
+    capacity = newCapacity;
+    peak = 0;
+}
+
+void* FrameArena::do_allocate(size_t bytes, size_t alignment) {
+    size_t start = (used + alignment - 1) & ~(alignment - 1);
+    if (start + bytes <= capacity) {
+        used = start + bytes;
+        peak = std::max(peak, used);
+        return block + start;
+    }
+
+    overflows++;
+    void* p = ::operator new(bytes);
+    overflowAllocations.emplace_back(p, bytes);
+    return p;
+}
+
+void FrameArena::do_deallocate(void*, size_t, size_t) {
+    // Everything is released at once in reset()
+}
+
+bool FrameArena::do_is_equal(const std::pmr::memory_resource& other) const noexcept {
+    return this == &other;
+}
@@ -0,0 +1,644 @@
+#include "Federation.h"
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+
+namespace
+{
+    // Batch frame plaintext: "FED2", the u64 sequence number, records of [u8 type][u32 length][payload]
+    // and the HMAC of everything before it
+    const std::string BATCH_MAGIC = "FED2";
+    constexpr size_t SEQUENCE_SIZE = sizeof(uint64_t);
+    constexpr size_t MAC_SIZE = 32;
+    constexpr char RECORD_JOIN = 'J';
+    constexpr char RECORD_LEAVE = 'L';
+    constexpr char RECORD_CHAT = 'M';
+    constexpr size_t NONCE_SIZE = 16;
+    constexpr size_t READ_BYTES = 16 * 1024;
+
+    void setLinkOptions(int fd)
+    {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+
+    FreiaEncryption::Key hmacSha256(const FreiaEncryption::Key& key, std::string_view data)
+    {
+        FreiaEncryption::Key out{};
+        unsigned int length = out.size();
+        HMAC(EVP_sha256(), key.data(), key.size(),
+             reinterpret_cast<const unsigned char*>(data.data()), data.size(), out.data(), &length);
+        return out;
+    }
+}
+
+Federation::~Federation()
+{
+    shutdown();
+}
+
+bool Federation::start(const Config& config, const FreiaEncryption::Key& serverKey)
+{
+    nodeId = config.nodeId;
+    key = serverKey;
+    maxRemoteUsers = config.maxRemoteUsers;
+    maxLinks = config.maxLinks;
+    sendBufferBytes = config.sendBufferBytes;
+
+    if (config.port > 0)
+    {
+        listenFd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listenFd < 0) return false;
+        int opt = 1;
+        setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = INADDR_ANY;
+        addr.sin_port = htons(config.port);
+        if (bind(listenFd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || listen(listenFd, 16) < 0) {
+            std::cerr << "[Federation] Failed to listen on port " << config.port << " (errno=" << errno << ")\n";
+            close(listenFd);
+            listenFd = -1;
+            return false;
+        }
+        std::cout << "[Federation] Node " << nodeId << " accepting peers on port " << config.port << "\n";
+    }
+
+    // Names are resolved here once, a blocking lookup later on would stall the server loop
+    for (const auto& address : config.peers) {
+        Link link;
+        link.address = address;
+        link.dialed = true;
+        if (!resolve(link)) {
+            std::cerr << "[Federation] Cannot resolve peer " << address << ", not dialing it\n";
+            continue;
+        }
+        links.push_back(std::move(link));
+    }
+    active = true;
+    maintain();
+    return true;
+}
+
+void Federation::userJoined(const std::string& username)
+{
+    if (!active) return;
+    if (++localUsers[username] == 1) queueAll(RECORD_JOIN, username);
+}
+
+void Federation::userLeft(const std::string& username)
+{
+    auto it = localUsers.find(username);
+    if (!active || it == localUsers.end()) return;
+    if (--it->second > 0) return;
+    localUsers.erase(it);
+    queueAll(RECORD_LEAVE, username);
+}
+
+void Federation::publishChat(std::string_view frame)
+{
+    if (active) queueAll(RECORD_CHAT, frame);
+}
+
+std::vector<Federation::WatchedSocket> Federation::watchedSockets() const
+{
+    std::vector<WatchedSocket> sockets;
+    if (listenFd >= 0) sockets.push_back(WatchedSocket{listenFd, 0, false});
+    for (const auto& link : links) {
+        if (link.fd < 0) continue;
+        bool wantsWrite = link.state == LinkState::Connecting || !link.sendBuffer.empty();
+        sockets.push_back(WatchedSocket{link.fd, link.id, wantsWrite});
+    }
+    return sockets;
+}
+
+void Federation::handleReady(int fd, uint32_t id, bool readable, bool writable)
+{
+    if (fd < 0) return;
+
+    if (fd == listenFd && id == 0)
+    {
+        if (readable) acceptPeer();
+        return;
+    }
+
+    Link* link = findLink(fd, id);
+    if (!link) return;
+
+    if (writable && link->state == LinkState::Connecting)
+    {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error != 0) {
+            dropLink(*link, "connect failed");
+            return;
+        }
+        if (!sendHello(*link)) {
+            dropLink(*link, "send failed");
+            return;
+        }
+    }
+    else if (writable && !flushSendBuffer(*link))
+    {
+        dropLink(*link, "send failed");
+        return;
+    }
+
+    if (readable && link->state != LinkState::Connecting) readFrames(*link);
+}
+
+int Federation::maintain()
+{
+    if (!active) return -1;
+
+    // Accepted links are gone for good once closed, the peer dials again
+    links.erase(std::remove_if(links.begin(), links.end(),
+                               [](const Link& link) { return !link.dialed && link.fd < 0; }),
+                links.end());
+
+    time_t now = time(nullptr);
+    int wait = -1;
+    auto waitUntil = [&](time_t when) {
+        int left = static_cast<int>(std::max<time_t>(0, when - now));
+        wait = (wait < 0) ? left : std::min(wait, left);
+    };
+
+    for (auto& link : links)
+    {
+        if (link.fd >= 0 && link.state != LinkState::Up) {
+            if (now < link.deadline) {
+                waitUntil(link.deadline);
+                continue;
+            }
+            dropLink(link, "handshake timed out");
+        }
+        if (!link.dialed || link.fd >= 0 || coveredByLiveLink(link)) continue;
+
+        if (now >= link.nextAttempt && maxLinks > 0 && openLinks() >= maxLinks)
+            link.nextAttempt = now + RETRY_SECONDS;
+        if (now >= link.nextAttempt)
+        {
+            link.nextAttempt = now + RETRY_SECONDS;
+            dial(link);
+            if (link.fd >= 0) {
+                waitUntil(link.deadline);
+                continue;
+            }
+        }
+        waitUntil(link.nextAttempt);
+    }
+    return wait;
+}
+
+void Federation::flush()
+{
+    for (auto& link : links)
+    {
+        if (link.state == LinkState::Up && !link.outbox.empty()) sendBatch(link);
+    }
+}
+
+void Federation::shutdown()
+{
+    for (auto& link : links) {
+        if (link.fd >= 0) close(link.fd);
+        link.fd = -1;
+    }
+    links.clear();
+    remoteUserCount = 0;
+    remoteUserLinks.clear();
+    if (listenFd >= 0) close(listenFd);
+    listenFd = -1;
+    active = false;
+}
+
+std::vector<Federation::Event> Federation::takeEvents()
+{
+    std::vector<Event> taken;
+    taken.swap(events);
+    return taken;
+}
+
+// Worst case of one link: a full send buffer plus the frame that went over it, a frame being
+// received plus one read, a batch being filled and the events of one readiness. The buffers are
+// reserved at that size when the link opens, so they don't grow past it, see openLink.
+size_t Federation::bufferBytes(const Config& config)
+{
+    size_t linkBytes = sizeof(Link) + config.sendBufferBytes + sizeof(uint32_t) + MAX_LINK_FRAME +
+                       sizeof(uint32_t) + MAX_LINK_FRAME + READ_BYTES + MAX_LINK_FRAME + MAX_LINK_FRAME;
+    // plus one decrypted frame at a time
+    return config.maxLinks * linkBytes + MAX_LINK_FRAME;
+}
+
+bool Federation::resolve(Link& link)
+{
+    size_t colon = link.address.rfind(':');
+    if (colon == std::string::npos) return false;
+    std::string host = link.address.substr(0, colon);
+    std::string port = link.address.substr(colon + 1);
+
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* result = nullptr;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &result) != 0 || !result) return false;
+
+    std::memcpy(&link.peerAddress, result->ai_addr, result->ai_addrlen);
+    link.peerAddressLength = result->ai_addrlen;
+    freeaddrinfo(result);
+    return true;
+}
+
+// Starts a non-blocking connect, the handshake begins once the socket is writable
+void Federation::dial(Link& link)
+{
+    int fd = socket(link.peerAddress.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return;
+    setLinkOptions(fd);
+
+    openLink(link, fd);
+    link.state = LinkState::Connecting;
+    if (connect(fd, reinterpret_cast<sockaddr*>(&link.peerAddress), link.peerAddressLength) == 0) {
+        if (!sendHello(link)) dropLink(link, "send failed");
+    }
+    else if (errno != EINPROGRESS) {
+        dropLink(link, "connect failed");
+    }
+}
+
+void Federation::acceptPeer()
+{
+    int conn = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (conn < 0) return;
+    // Unauthenticated peers could take up buffers without end otherwise
+    if (maxLinks > 0 && openLinks() >= maxLinks) {
+        close(conn);
+        return;
+    }
+    setLinkOptions(conn);
+
+    links.emplace_back();
+    openLink(links.back(), conn);
+    if (!sendHello(links.back())) dropLink(links.back(), "send failed");
+}
+
+// Buffers get their full size up front, charged as such in bufferBytes. Untouched pages cost nothing.
+void Federation::openLink(Link& link, int fd)
+{
+    link.fd = fd;
+    link.id = ++nextLinkId;
+    link.deadline = time(nullptr) + LINK_TIMEOUT_SECONDS;
+    link.sendBuffer.reserve(sendBufferBytes + sizeof(uint32_t) + MAX_LINK_FRAME);
+    link.receiveBuffer.reserve(sizeof(uint32_t) + MAX_LINK_FRAME + READ_BYTES);
+    link.outbox.reserve(MAX_LINK_FRAME);
+}
+
+size_t Federation::openLinks() const
+{
+    size_t open = 0;
+    for (const auto& link : links) {
+        if (link.fd >= 0) open++;
+    }
+    return open;
+}
+
+// Both sides send their node id and a fresh nonce, then prove with AUTH that they derived
+// the same link keys, which only nodes that know the server password can
+bool Federation::sendHello(Link& link)
+{
+    unsigned char nonceRaw[NONCE_SIZE];
+    if (RAND_bytes(nonceRaw, sizeof(nonceRaw)) != 1) return false;
+    link.nonce = FreiaEncryption::base64_encode(std::string(reinterpret_cast<char*>(nonceRaw), sizeof(nonceRaw)));
+    link.state = LinkState::Handshake;
+    link.sendSequence = 0;
+    link.receiveSequence = 0;
+    return sendFrame(link, "FED2 HELLO\n" + nodeId + "\n" + link.nonce);
+}
+
+// Both ends put the (node id, nonce) pairs in node id order and get the same keys. Each
+// direction has its own MAC key, a node's batches can't be reflected back at it.
+void Federation::deriveLinkKeys(Link& link, std::string_view peerNonce)
+{
+    std::string ours = nodeId + "\n" + link.nonce;
+    std::string theirs = link.peerId + "\n" + std::string(peerNonce);
+    std::string transcript = (nodeId < link.peerId) ? ours + "\n" + theirs : theirs + "\n" + ours;
+    link.linkKey = hmacSha256(key, "FED2 LINK\n" + transcript);
+    link.sendMacKey = hmacSha256(key, "FED2 MAC " + nodeId + "\n" + transcript);
+    link.receiveMacKey = hmacSha256(key, "FED2 MAC " + link.peerId + "\n" + transcript);
+}
+
+// Reads what the socket has and handles every complete frame, a bounded amount per readiness
+void Federation::readFrames(Link& link)
+{
+    char chunk[READ_BYTES];
+    for (int reads = 0; reads < 16 && link.fd >= 0; ++reads)
+    {
+        ssize_t r = recv(link.fd, chunk, sizeof(chunk), MSG_DONTWAIT);
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        if (r <= 0) {
+            dropLink(link, "link closed");
+            return;
+        }
+        link.receiveBuffer.append(chunk, static_cast<size_t>(r));
+
+        size_t pos = 0;
+        while (link.fd >= 0 && link.receiveBuffer.size() - pos >= sizeof(uint32_t))
+        {
+            uint32_t lengthNet = 0;
+            std::memcpy(&lengthNet, link.receiveBuffer.data() + pos, sizeof(lengthNet));
+            uint32_t length = ntohl(lengthNet);
+            if (length == 0 || length > MAX_LINK_FRAME) {
+                dropLink(link, "invalid frame length");
+                return;
+            }
+            if (link.receiveBuffer.size() - pos - sizeof(lengthNet) < length) break;
+
+            std::string_view encrypted(link.receiveBuffer.data() + pos + sizeof(lengthNet), length);
+            pos += sizeof(lengthNet) + length;
+            std::string plaintext(length, '\0');
+            const FreiaEncryption::Key& frameKey = (link.state == LinkState::Up) ? link.linkKey : key;
+            size_t plaintextLength = FreiaEncryption::decryptInto(encrypted, frameKey, plaintext.data(), plaintext.size());
+            if (plaintextLength == 0) {
+                dropLink(link, "undecryptable frame");
+                return;
+            }
+            plaintext.resize(plaintextLength);
+            if (!handleFrame(link, plaintext)) return;
+        }
+        if (link.fd >= 0) link.receiveBuffer.erase(0, pos);
+    }
+}
+
+// The handshake is the peer's HELLO and then its AUTH, everything after that is batches.
+// Returns false when the link was dropped.
+bool Federation::handleFrame(Link& link, std::string_view plaintext)
+{
+    if (link.state == LinkState::Up)
+    {
+        if (applyBatch(link, plaintext)) return true;
+        dropLink(link, "malformed or forged batch");
+        return false;
+    }
+
+    if (link.state == LinkState::Handshake)
+    {
+        size_t first = plaintext.find('\n');
+        size_t second = (first == std::string_view::npos) ? first : plaintext.find('\n', first + 1);
+        if (second == std::string_view::npos || plaintext.substr(0, first) != "FED2 HELLO") {
+            dropLink(link, "bad handshake");
+            return false;
+        }
+        std::string peerId(plaintext.substr(first + 1, second - first - 1));
+        std::string_view peerNonce = plaintext.substr(second + 1);
+        if (peerId.empty() || peerId == nodeId) {
+            std::cerr << "[Federation] Refusing link to node id '" << peerId << "'\n";
+            dropLink(link, "bad node id");
+            return false;
+        }
+        link.peerId = peerId;
+        deriveLinkKeys(link, peerNonce);
+        link.state = LinkState::Authenticating;
+        FreiaEncryption::Key proof = hmacSha256(link.sendMacKey, "FED2 AUTH");
+        if (sendFrame(link, "FED2 AUTH\n" + std::string(reinterpret_cast<const char*>(proof.data()), proof.size())))
+            return true;
+        dropLink(link, "send failed");
+        return false;
+    }
+
+    const std::string_view authPrefix = "FED2 AUTH\n";
+    FreiaEncryption::Key expected = hmacSha256(link.receiveMacKey, "FED2 AUTH");
+    bool authentic = link.state == LinkState::Authenticating &&
+                     plaintext.size() == authPrefix.size() + expected.size() &&
+                     plaintext.substr(0, authPrefix.size()) == authPrefix &&
+                     CRYPTO_memcmp(plaintext.data() + authPrefix.size(), expected.data(), expected.size()) == 0;
+    if (!authentic) {
+        std::cerr << "[Federation] Peer " << link.peerId << " failed authentication\n";
+        dropLink(link, "authentication failed");
+        return false;
+    }
+    if (!linkUp(link)) {
+        dropLink(link, "duplicate link");
+        return false;
+    }
+    return true;
+}
+
+// Registers a freshly authenticated link and sends it our presence
+bool Federation::linkUp(Link& link)
+{
+    for (auto& other : links)
+    {
+        if (&other == &link || other.state != LinkState::Up || other.peerId != link.peerId) continue;
+
+        // Both nodes dialed each other: keep the link dialed by the smaller node id, both sides agree on it
+        const std::string& otherDialer = other.dialed ? nodeId : other.peerId;
+        const std::string& newDialer = link.dialed ? nodeId : link.peerId;
+        if (otherDialer <= newDialer) return false;
+        dropLink(other, "replaced by a new link");
+    }
+
+    std::cout << "[Federation] Linked with node " << link.peerId << "\n";
+    link.state = LinkState::Up;
+    link.outbox.clear();
+    for (const auto& [username, count] : localUsers) queue(link, RECORD_JOIN, username);
+    return true;
+}
+
+bool Federation::coveredByLiveLink(const Link& link) const
+{
+    if (link.peerId.empty()) return false;
+    for (const auto& other : links) {
+        if (&other != &link && other.state == LinkState::Up && other.peerId == link.peerId) return true;
+    }
+    return false;
+}
+
+// Only links that were up are reported, a failed dial or handshake is retried quietly
+void Federation::dropLink(Link& link, const std::string& reason)
+{
+    if (link.fd < 0) return;
+    if (link.state == LinkState::Up)
+        std::cout << "[Federation] Lost node " << link.peerId << " (" << reason << ")\n";
+    close(link.fd);
+    link.fd = -1;
+    link.state = LinkState::Down;
+    link.nonce.clear();
+    link.linkKey = {};
+    link.sendMacKey = {};
+    link.receiveMacKey = {};
+    // A link that is down holds no buffers, openLink reserves them again
+    std::string().swap(link.outbox);
+    std::string().swap(link.sendBuffer);
+    std::string().swap(link.receiveBuffer);
+    link.nextAttempt = time(nullptr) + RETRY_SECONDS;
+
+    // Users of that node are offline as far as this node can tell
+    std::unordered_set<std::string> users;
+    users.swap(link.users);
+    remoteUserCount -= users.size();
+    for (const auto& username : users) {
+        if (removeRemoteUser(username)) events.push_back(Event{Event::UserLeft, username, {}});
+    }
+}
+
+// Encrypts a frame onto the link's send buffer and writes what the socket takes without blocking
+bool Federation::sendFrame(Link& link, std::string_view plaintext)
+{
+    size_t start = link.sendBuffer.size();
+    size_t capacity = plaintext.size() + 32;
+    link.sendBuffer.resize(start + sizeof(uint32_t) + capacity);
+    const FreiaEncryption::Key& frameKey = (link.state == LinkState::Up) ? link.linkKey : key;
+    size_t length = FreiaEncryption::encryptInto(plaintext, frameKey, link.sendBuffer.data() + start + sizeof(uint32_t),
+                                                 capacity);
+    if (length == 0) {
+        link.sendBuffer.resize(start);
+        return false;
+    }
+    uint32_t lengthNet = htonl(static_cast<uint32_t>(length));
+    std::memcpy(link.sendBuffer.data() + start, &lengthNet, sizeof(lengthNet));
+    link.sendBuffer.resize(start + sizeof(lengthNet) + length);
+
+    // The peer is not reading
+    if (link.sendBuffer.size() > sendBufferBytes) return false;
+    return flushSendBuffer(link);
+}
+
+// The rest waits until the socket is writable again, see watchedSockets
+bool Federation::flushSendBuffer(Link& link)
+{
+    size_t sent = 0;
+    while (sent < link.sendBuffer.size())
+    {
+        ssize_t r = send(link.fd, link.sendBuffer.data() + sent, link.sendBuffer.size() - sent,
+                         MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (r <= 0) return false;
+        sent += static_cast<size_t>(r);
+    }
+    link.sendBuffer.erase(0, sent);
+    return true;
+}
+
+// Seals the outbox with its sequence number and MAC, returns false when the link was dropped
+bool Federation::sendBatch(Link& link)
+{
+    uint64_t sequence = link.sendSequence++;
+    for (size_t i = 0; i < SEQUENCE_SIZE; ++i)
+        link.outbox[BATCH_MAGIC.size() + i] = static_cast<char>(sequence >> (8 * (SEQUENCE_SIZE - 1 - i)));
+    FreiaEncryption::Key mac = hmacSha256(link.sendMacKey, link.outbox);
+    link.outbox.append(reinterpret_cast<const char*>(mac.data()), mac.size());
+
+    bool sent = sendFrame(link, link.outbox);
+    link.outbox.clear();
+    if (!sent) dropLink(link, "send failed");
+    return sent;
+}
+
+void Federation::queue(Link& link, char type, std::string_view payload)
+{
+    if (link.outbox.empty()) {
+        link.outbox = BATCH_MAGIC;
+        link.outbox.append(SEQUENCE_SIZE, '\0');   // filled in by sendBatch
+    }
+    uint32_t lengthNet = htonl(static_cast<uint32_t>(payload.size()));
+    link.outbox.push_back(type);
+    link.outbox.append(reinterpret_cast<const char*>(&lengthNet), sizeof(lengthNet));
+    link.outbox.append(payload);
+
+    if (link.outbox.size() >= BATCH_BYTES) sendBatch(link);
+}
+
+void Federation::queueAll(char type, std::string_view payload)
+{
+    for (auto& link : links) {
+        if (link.state == LinkState::Up) queue(link, type, payload);
+    }
+}
+
+bool Federation::applyBatch(Link& link, std::string_view batch)
+{
+    size_t pos = BATCH_MAGIC.size() + SEQUENCE_SIZE;
+    if (batch.size() < pos + MAC_SIZE || batch.substr(0, BATCH_MAGIC.size()) != BATCH_MAGIC) return false;
+    std::string_view sealed = batch.substr(0, batch.size() - MAC_SIZE);
+    FreiaEncryption::Key expected = hmacSha256(link.receiveMacKey, sealed);
+    if (CRYPTO_memcmp(expected.data(), batch.data() + sealed.size(), MAC_SIZE) != 0) return false;
+
+    // TCP keeps batches in order, any other number was replayed or cut out on the way
+    uint64_t sequence = 0;
+    for (size_t i = 0; i < SEQUENCE_SIZE; ++i)
+        sequence = (sequence << 8) | static_cast<unsigned char>(batch[BATCH_MAGIC.size() + i]);
+    if (sequence != link.receiveSequence++) return false;
+    batch = sealed;
+    bool full = false;
+
+    while (pos < batch.size())
+    {
+        if (batch.size() - pos < 1 + sizeof(uint32_t)) return false;
+        char type = batch[pos];
+        uint32_t lengthNet = 0;
+        std::memcpy(&lengthNet, batch.data() + pos + 1, sizeof(lengthNet));
+        uint32_t length = ntohl(lengthNet);
+        pos += 1 + sizeof(lengthNet);
+        if (batch.size() - pos < length) return false;
+        std::string payload(batch.substr(pos, length));
+        pos += length;
+
+        if (type == RECORD_JOIN) {
+            if (payload.size() > UsernameTable::MAX_LENGTH || link.users.count(payload)) continue;
+            if (maxRemoteUsers > 0 && remoteUserCount >= maxRemoteUsers) {
+                if (!full) std::cerr << "[Federation] Remote user limit reached, presence from "
+                                     << link.peerId << " is incomplete\n";
+                full = true;
+                continue;
+            }
+            link.users.insert(payload);
+            remoteUserCount++;
+            if (addRemoteUser(payload)) events.push_back(Event{Event::UserJoined, payload, {}});
+        } else if (type == RECORD_LEAVE) {
+            if (!link.users.erase(payload)) continue;
+            remoteUserCount--;
+            if (removeRemoteUser(payload)) events.push_back(Event{Event::UserLeft, payload, {}});
+        } else if (type == RECORD_CHAT) {
+            events.push_back(Event{Event::Chat, {}, std::move(payload)});
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+Federation::Link* Federation::findLink(int fd, uint32_t id)
+{
+    for (auto& link : links) {
+        if (link.fd == fd && link.id == id) return &link;
+    }
+    return nullptr;
+}
+
+// True when the user was not announced by any other link
+bool Federation::addRemoteUser(const std::string& username)
+{
+    return ++remoteUserLinks[username] == 1;
+}
+
+// True when no link announces the user anymore
+bool Federation::removeRemoteUser(const std::string& username)
+{
+    auto it = remoteUserLinks.find(username);
+    if (it == remoteUserLinks.end() || --it->second > 0) return false;
+    remoteUserLinks.erase(it);
+    return true;
+}
@@ -0,0 +1,197 @@
+#include "FileRelay.h"
+#include <algorithm>
+#include <openssl/rand.h>
+
+std::optional<uint64_t> FileRelay::offer(uint32_t id, int senderSocket, const std::string& owner, uint64_t totalSize) {
+    if (streams.count(id)) return std::nullopt;
+    if (atStreamLimit(senderSocket, owner)) return std::nullopt;
+
+    // The PROT2 username is only a claim, taking over a stream needs this secret as well
+    Stream stream;
+    if (RAND_bytes(reinterpret_cast<unsigned char*>(&stream.resumeSecret), sizeof(stream.resumeSecret)) != 1)
+        return std::nullopt;
+    stream.owner = owner;
+    stream.senderSocket = senderSocket;
+    stream.totalSize = totalSize;
+    stream.lastActivity = time(nullptr);
+    uint64_t secret = stream.resumeSecret;
+    streams.emplace(id, std::move(stream));
+    return secret;
+}
+
+std::optional<uint64_t> FileRelay::accept(uint32_t id, int receiverSocket, uint64_t offset) {
+    auto it = streams.find(id);
+    if (it == streams.end() || it->second.senderSocket == receiverSocket) return std::nullopt;
+    if (!it->second.receivers.count(receiverSocket) && atStreamLimit(receiverSocket)) return std::nullopt;
+
+    Stream& stream = it->second;
+    offset = std::min(offset, stream.totalSize);
+    Receiver& receiver = stream.receivers[receiverSocket];
+    receiver.nextOffset = offset;
+    receiver.ackedOffset = offset;
+    stream.lastActivity = time(nullptr);
+
+    // A receiver that is behind makes the sender rewind, the others skip what they have
+    stream.relayedOffset = std::min(stream.relayedOffset, offset);
+    updatePause(stream);
+    return stream.relayedOffset;
+}
+
+std::optional<uint64_t> FileRelay::resume(uint32_t id, int senderSocket, const std::string& owner, uint64_t secret) {
+    auto it = streams.find(id);
+    if (it == streams.end() || it->second.owner != owner || it->second.resumeSecret != secret) return std::nullopt;
+
+    Stream& stream = it->second;
+    stream.senderSocket = senderSocket;
+    stream.lastActivity = time(nullptr);
+
+    // Anything not acknowledged may have been lost with the old connection
+    for (auto& [sock, receiver] : stream.receivers) {
+        receiver.nextOffset = receiver.ackedOffset;
+    }
+    stream.relayedOffset = stream.receivers.empty() ? 0 : slowestAck(stream);
+    updatePause(stream);
+    return stream.relayedOffset;
+}
+
+void FileRelay::ack(uint32_t id, int receiverSocket, uint64_t offset) {
+    auto it = streams.find(id);
+    if (it == streams.end()) return;
+
+    auto receiver = it->second.receivers.find(receiverSocket);
+    if (receiver == it->second.receivers.end()) return;
+
+    // Never trust an ACK for data that was not relayed yet
+    offset = std::min(offset, receiver->second.nextOffset);
+    receiver->second.ackedOffset = std::max(receiver->second.ackedOffset, offset);
+    it->second.lastActivity = time(nullptr);
+    updatePause(it->second);
+}
+
+std::vector<int> FileRelay::targetsFor(uint32_t id, int senderSocket, uint64_t offset, uint32_t length) {
+    std::vector<int> targets;
+    auto it = streams.find(id);
+    if (it == streams.end() || it->second.senderSocket != senderSocket) return targets;
+
+    Stream& stream = it->second;
+    uint64_t end = offset + length;
+    for (auto& [sock, receiver] : stream.receivers) {
+        if (end <= receiver.nextOffset || offset > receiver.nextOffset) continue;
+        receiver.nextOffset = end;
+        targets.push_back(sock);
+    }
+    stream.relayedOffset = std::max(stream.relayedOffset, end);
+    stream.lastActivity = time(nullptr);
+    updatePause(stream);
+    return targets;
+}
+
+void FileRelay::removeReceiver(uint32_t id, int receiverSocket) {
+    auto it = streams.find(id);
+    if (it == streams.end()) return;
+    it->second.receivers.erase(receiverSocket);
+    updatePause(it->second);
+}
+
+std::optional<FileRelay::Stream> FileRelay::close(uint32_t id, int senderSocket) {
+    auto it = streams.find(id);
+    if (it == streams.end() || it->second.senderSocket != senderSocket) return std::nullopt;
+
+    setPausing(it->second, -1);
+    Stream stream = std::move(it->second);
+    streams.erase(it);
+    return stream;
+}
+
+void FileRelay::dropSocket(int sock) {
+    congestedReceivers.erase(sock);
+    for (auto& [id, stream] : streams) {
+        if (stream.senderSocket == sock) stream.senderSocket = -1;
+        stream.receivers.erase(sock);
+        updatePause(stream);
+    }
+    expireIdle();
+    dropExcessOrphans();
+}
+
+void FileRelay::expireIdle() {
+    time_t now = time(nullptr);
+    for (auto it = streams.begin(); it != streams.end();) {
+        if (now - it->second.lastActivity > MAX_IDLE_SECONDS) {
+            setPausing(it->second, -1);
+            it = streams.erase(it);
+        }
+        else
+            ++it;
+    }
+}
+
+// Called for every queued frame, the streams are only looked at when the receiver's state flips
+void FileRelay::setCongested(int receiverSocket, bool congested) {
+    bool changed = congested ? congestedReceivers.insert(receiverSocket).second
+                             : congestedReceivers.erase(receiverSocket) > 0;
+    if (!changed) return;
+    for (auto& [id, stream] : streams) {
+        if (stream.receivers.count(receiverSocket)) updatePause(stream);
+    }
+}
+
+// A stream holds its sender back while it is a window ahead of the slowest ACK or one of its
+// receivers has output waiting
+void FileRelay::updatePause(Stream& stream) {
+    bool paused = false;
+    if (stream.senderSocket >= 0 && !stream.receivers.empty()) {
+        paused = stream.relayedOffset > slowestAck(stream) + WINDOW_BYTES;
+        for (auto it = stream.receivers.begin(); !paused && it != stream.receivers.end(); ++it)
+            paused = congestedReceivers.count(it->first) > 0;
+    }
+    setPausing(stream, paused ? stream.senderSocket : -1);
+}
+
+void FileRelay::setPausing(Stream& stream, int senderSocket) {
+    if (stream.pausing == senderSocket) return;
+    if (stream.pausing >= 0) {
+        auto it = pausedSenders.find(stream.pausing);
+        if (it != pausedSenders.end() && --it->second == 0) pausedSenders.erase(it);
+    }
+    if (senderSocket >= 0) ++pausedSenders[senderSocket];
+    stream.pausing = senderSocket;
+}
+
+const FileRelay::Stream* FileRelay::find(uint32_t id) const {
+    auto it = streams.find(id);
+    return it == streams.end() ? nullptr : &it->second;
+}
+
+uint64_t FileRelay::slowestAck(const Stream& stream) {
+    uint64_t slowest = UINT64_MAX;
+    for (const auto& [sock, receiver] : stream.receivers) {
+        slowest = std::min(slowest, receiver.ackedOffset);
+    }
+    return slowest == UINT64_MAX ? 0 : slowest;
+}
+
+// Streams the owner left behind count as well, reconnecting must not open another set
+bool FileRelay::atStreamLimit(int sock, const std::string& owner) const {
+    if (maxStreamsPerSocket == 0) return false;
+    size_t open = 0;
+    for (const auto& [id, stream] : streams) {
+        bool orphaned = stream.senderSocket == -1 && !owner.empty() && stream.owner == owner;
+        if (orphaned || stream.senderSocket == sock || stream.receivers.count(sock)) open++;
+    }
+    return open >= maxStreamsPerSocket;
+}
+
+// Usernames are only claimed, so the owner limit alone does not bound what dropped senders leave
+void FileRelay::dropExcessOrphans() {
+    if (maxOrphanedStreams == 0) return;
+    std::vector<std::pair<time_t, uint32_t>> orphans;
+    for (const auto& [id, stream] : streams) {
+        if (stream.senderSocket == -1) orphans.emplace_back(stream.lastActivity, id);
+    }
+    if (orphans.size() <= maxOrphanedStreams) return;
+
+    // Orphans have no sender, so none of them is counted in pausedSenders
+    std::sort(orphans.begin(), orphans.end());
+    for (size_t i = 0; i < orphans.size() - maxOrphanedStreams; ++i) streams.erase(orphans[i].second);
+}
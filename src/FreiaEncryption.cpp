@@ -36,8 +36,8 @@ std::string FreiaEncryption::base64_decode(const std::string& in)
         unsigned char d = (i + 3 < in.size() && in[i + 3] != '=') ? (strchr(b64.c_str(), in[i + 3]) - b64.c_str()) : 0;
 
         out.push_back((a << 2) | (b >> 4));
-        if (i + 1 < in.size() && in[i + 1] != '=') out.push_back((b << 4) | (c >> 2));
-        if (i + 2 < in.size() && in[i + 2] != '=') out.push_back((c << 6) | d);
+        if (i + 2 < in.size() && in[i + 2] != '=') out.push_back((b << 4) | (c >> 2));
+        if (i + 3 < in.size() && in[i + 3] != '=') out.push_back((c << 6) | d);
 
         i += 4;
     }
@@ -45,75 +45,89 @@ std::string FreiaEncryption::base64_decode(const std::string& in)
 }
 
 std::string FreiaEncryption::encryptData(const std::string& data, const Key& key) {
+    std::string result(data.size() + 32, '\0');
+    size_t len = encryptInto(data, key, result.data(), result.size());
+    result.resize(len);
+    return result;
+}
+
+std::string FreiaEncryption::decryptData(const std::string& data, const Key& key) {
+    std::string result(data.size(), '\0');
+    size_t len = decryptInto(data, key, result.data(), result.size());
+    result.resize(len);
+    return result;
+}
+
+size_t FreiaEncryption::encryptInto(std::string_view data, const Key& key, char* out, size_t outCapacity) {
     // unsigned char key[32];
     // PKCS5_PBKDF2_HMAC(password.c_str(), password.size(), nullptr, 0, 100000, EVP_sha256(), 32, key);
 
-    unsigned char iv[16];
-    if (RAND_bytes(iv, 16) != 1) return "";
+    if (outCapacity < data.size() + 32) return 0;
+
+    // Output is [16 byte IV][ciphertext], the IV is written in place
+    unsigned char* iv = reinterpret_cast<unsigned char*>(out);
+    unsigned char* ciphertext = iv + 16;
+    if (RAND_bytes(iv, 16) != 1) return 0;
 
     EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
-    if (!ctx) return "";
+    if (!ctx) return 0;
 
     if (!EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), nullptr, key.data(), iv)) {
         EVP_CIPHER_CTX_free(ctx);
-        return "";
+        return 0;
     }
 
     int len, ciphertext_len;
-    std::vector<unsigned char> ciphertext(data.size() + 16);
-
-    if (!EVP_EncryptUpdate(ctx, ciphertext.data(), &len, (unsigned char*)data.data(), data.size())) {
+    if (!EVP_EncryptUpdate(ctx, ciphertext, &len, reinterpret_cast<const unsigned char*>(data.data()), data.size())) {
         EVP_CIPHER_CTX_free(ctx);
-        return "";
+        return 0;
     }
     ciphertext_len = len;
 
-    if (!EVP_EncryptFinal_ex(ctx, ciphertext.data() + len, &len)) {
+    if (!EVP_EncryptFinal_ex(ctx, ciphertext + len, &len)) {
         EVP_CIPHER_CTX_free(ctx);
-        return "";
+        return 0;
     }
     ciphertext_len += len;
-    ciphertext.resize(ciphertext_len);
     EVP_CIPHER_CTX_free(ctx);
 
-    std::string result;
-    result.append((char*)iv, 16);
-    result.append((char*)ciphertext.data(), ciphertext_len);
-    return result;
+    return 16 + static_cast<size_t>(ciphertext_len);
 }
 
-std::string FreiaEncryption::decryptData(const std::string& data, const Key& key) {
-    if (data.size() < 16) return "";
-    std::string iv_str = data.substr(0, 16);
-    std::string ciphertext = data.substr(16);
+size_t FreiaEncryption::decryptInto(std::string_view data, const Key& key, char* out, size_t outCapacity) {
+    if (data.size() < 16) return 0;
+    // IV and ciphertext are read in place, no copies
+    const unsigned char* iv = reinterpret_cast<const unsigned char*>(data.data());
+    const unsigned char* ciphertext = iv + 16;
+    size_t ciphertextSize = data.size() - 16;
 
-    // unsigned char key[32];
-    // PKCS5_PBKDF2_HMAC(password.c_str(), password.size(), nullptr, 0, 100000, EVP_sha256(), 32, key);
+    // OpenSSL wants one block of slack on top of the ciphertext
+    if (outCapacity < ciphertextSize + 16) return 0;
 
     EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
-    if (!EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), nullptr, key.data(), (unsigned char*)iv_str.c_str())) {
+    if (!ctx) return 0;
+
+    if (!EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), nullptr, key.data(), iv)) {
         EVP_CIPHER_CTX_free(ctx);
-        return "";
+        return 0;
     }
 
+    unsigned char* plaintext = reinterpret_cast<unsigned char*>(out);
     int len, plaintext_len;
-    std::vector<unsigned char> plaintext(ciphertext.size());
-
-    if (!EVP_DecryptUpdate(ctx, plaintext.data(), &len, (unsigned char*)ciphertext.data(), ciphertext.size())) {
+    if (!EVP_DecryptUpdate(ctx, plaintext, &len, ciphertext, ciphertextSize)) {
         EVP_CIPHER_CTX_free(ctx);
-        return "";
+        return 0;
     }
     plaintext_len = len;
 
-    if (EVP_DecryptFinal_ex(ctx, plaintext.data() + len, &len) <= 0) {
+    if (EVP_DecryptFinal_ex(ctx, plaintext + len, &len) <= 0) {
         EVP_CIPHER_CTX_free(ctx);
-        return "";
+        return 0;
     }
     plaintext_len += len;
     EVP_CIPHER_CTX_free(ctx);
-    plaintext.resize(plaintext_len);
 
-    return std::string(plaintext.begin(), plaintext.end());
+    return static_cast<size_t>(plaintext_len);
 }
 
 FreiaEncryption::Key FreiaEncryption::deriveKey(const std::string& password)
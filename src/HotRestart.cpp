@@ -0,0 +1,263 @@
+#include "HotRestart.h"
+#include <iostream>
+#include <cstring>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+namespace
+{
+    constexpr size_t MAX_MESSAGE_SIZE = 128 * 1024;
+    constexpr time_t READY_TIMEOUT_SECONDS = 5;
+    // A process that speaks anything else is refused, the running one goes on serving
+    const std::string HANDOFF_MAGIC = "FREIA-HANDOFF 4";
+
+    bool fillAddress(const std::string& path, sockaddr_un& addr)
+    {
+        if (path.size() >= sizeof(addr.sun_path)) return false;
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        std::memcpy(addr.sun_path, path.c_str(), path.size());
+        return true;
+    }
+
+    // SEQPACKET keeps message boundaries, each message carries at most one fd
+    bool sendMessage(int conn, const std::string& payload, int fd = -1)
+    {
+        iovec iov{};
+        iov.iov_base = const_cast<char*>(payload.data());
+        iov.iov_len = payload.size();
+
+        msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+        if (fd >= 0) {
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+            std::memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+        }
+        return sendmsg(conn, &msg, MSG_NOSIGNAL) == static_cast<ssize_t>(payload.size());
+    }
+
+    bool receiveMessage(int conn, std::string& payload, int& fd)
+    {
+        payload.assign(MAX_MESSAGE_SIZE, '\0');
+        fd = -1;
+
+        iovec iov{};
+        iov.iov_base = payload.data();
+        iov.iov_len = payload.size();
+
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+        msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        ssize_t r = recvmsg(conn, &msg, 0);
+        if (r <= 0 || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) return false;
+        payload.resize(static_cast<size_t>(r));
+
+        for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+                std::memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+        }
+        return true;
+    }
+
+    // Pops the next '\n' terminated field from the front of s
+    bool nextField(std::string& s, std::string& field)
+    {
+        size_t end = s.find('\n');
+        if (end == std::string::npos) return false;
+        field = s.substr(0, end);
+        s.erase(0, end + 1);
+        return true;
+    }
+}
+
+int HotRestart::listenForUpgrade(const std::string& path)
+{
+    sockaddr_un addr{};
+    if (!fillAddress(path, addr)) return -1;
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+
+    unlink(path.c_str());
+    // The hand-off carries the server key, only the same user may connect. The mode of the
+    // socket is set on the fd, umask is per process and --local-nodes runs servers as threads.
+    if (fchmod(fd, 0600) < 0 || bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 ||
+        listen(fd, 1) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int HotRestart::acceptUpgrade(int controlSocket)
+{
+    int conn = accept4(controlSocket, nullptr, nullptr, SOCK_CLOEXEC);
+    if (conn < 0) return -1;
+
+    ucred peer{};
+    socklen_t peerLen = sizeof(peer);
+    if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &peer, &peerLen) < 0 || peer.uid != getuid()) {
+        std::cerr << "[Upgrade] Rejected hand-off request from uid " << peer.uid << "\n";
+        close(conn);
+        return -1;
+    }
+
+    // The serving loop is blocked while it waits for the new process, it must not wait forever
+    timeval timeout{READY_TIMEOUT_SECONDS, 0};
+    setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    std::string request;
+    int unused = -1;
+    if (!receiveMessage(conn, request, unused) || request != "UPGRADE") {
+        if (unused >= 0) close(unused);
+        close(conn);
+        return -1;
+    }
+    return conn;
+}
+
+bool HotRestart::sendState(int conn, const State& state)
+{
+    std::string keyRaw(reinterpret_cast<const char*>(state.serverKey.data()), state.serverKey.size());
+    std::string header = HANDOFF_MAGIC + "\n" +
+                         std::to_string(state.port) + "\n" +
+                         std::to_string(state.maxClients) + "\n" +
+                         FreiaEncryption::base64_encode(keyRaw) + "\n" +
+                         FreiaEncryption::base64_encode(state.ticketKeys) + "\n" +
+                         std::to_string(state.redeemedTickets.size()) + "\n" +
+                         std::to_string(state.clients.size()) + "\n";
+    if (!sendMessage(conn, header, state.listenFd)) return false;
+
+    // Redeemed ticket ids can be more than one message, they follow the header in pieces
+    for (size_t pos = 0; pos < state.redeemedTickets.size(); pos += MAX_MESSAGE_SIZE) {
+        if (!sendMessage(conn, state.redeemedTickets.substr(pos, MAX_MESSAGE_SIZE))) return false;
+    }
+
+    // slot, username and the lengths of the pending input and output, followed by their bytes.
+    // Records that do not fit into one message go on in the next ones, only the first carries the fd.
+    for (const auto& client : state.clients) {
+        std::string record = std::to_string(client.slot) + "\n" + client.username + "\n" +
+                             std::to_string(client.pendingInput.size()) + "\n" +
+                             std::to_string(client.pendingOutput.size()) + "\n" +
+                             client.pendingInput + client.pendingOutput;
+        if (!sendMessage(conn, record.substr(0, MAX_MESSAGE_SIZE), client.fd)) return false;
+        for (size_t pos = MAX_MESSAGE_SIZE; pos < record.size(); pos += MAX_MESSAGE_SIZE) {
+            if (!sendMessage(conn, record.substr(pos, MAX_MESSAGE_SIZE))) return false;
+        }
+    }
+
+    std::string reply;
+    int unused = -1;
+    bool ready = receiveMessage(conn, reply, unused) && reply == "READY";
+    if (unused >= 0) close(unused);
+    return ready;
+}
+
+bool HotRestart::sendDone(int conn)
+{
+    return sendMessage(conn, "DONE");
+}
+
+std::optional<HotRestart::State> HotRestart::receiveState(const std::string& path)
+{
+    sockaddr_un addr{};
+    if (!fillAddress(path, addr)) return std::nullopt;
+
+    int conn = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (conn < 0) return std::nullopt;
+    if (connect(conn, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || !sendMessage(conn, "UPGRADE")) {
+        std::cerr << "[Upgrade] No running server at " << path << "\n";
+        close(conn);
+        return std::nullopt;
+    }
+
+    State state;
+    std::string message, field;
+    bool ok = receiveMessage(conn, message, state.listenFd) && state.listenFd >= 0 &&
+              nextField(message, field) && field == HANDOFF_MAGIC;
+    if (!ok && field.rfind("FREIA-HANDOFF", 0) == 0)
+        std::cerr << "[Upgrade] Running server hands off " << field << ", expected " << HANDOFF_MAGIC << "\n";
+
+    size_t clientCount = 0;
+    try {
+        if (ok && nextField(message, field)) state.port = std::stoi(field); else ok = false;
+        if (ok && nextField(message, field)) state.maxClients = std::stoi(field); else ok = false;
+        if (ok && nextField(message, field)) {
+            std::string keyRaw = FreiaEncryption::base64_decode(field);
+            ok = keyRaw.size() == state.serverKey.size();
+            if (ok) std::memcpy(state.serverKey.data(), keyRaw.data(), keyRaw.size());
+        } else ok = false;
+        if (ok && nextField(message, field)) state.ticketKeys = FreiaEncryption::base64_decode(field); else ok = false;
+        size_t redeemedLength = 0;
+        if (ok && nextField(message, field)) redeemedLength = std::stoul(field); else ok = false;
+        if (ok && nextField(message, field)) clientCount = std::stoul(field); else ok = false;
+
+        while (ok && state.redeemedTickets.size() < redeemedLength) {
+            std::string more;
+            int unexpected = -1;
+            ok = receiveMessage(conn, more, unexpected) && unexpected < 0 && !more.empty();
+            if (unexpected >= 0) close(unexpected);
+            state.redeemedTickets += more;
+        }
+        ok = ok && state.redeemedTickets.size() == redeemedLength;
+
+        for (size_t i = 0; ok && i < clientCount; ++i) {
+            int fd = -1;
+            ok = receiveMessage(conn, message, fd) && fd >= 0;
+            if (!ok) break;
+            // Kept right away, so the fd is closed when the rest of the record is broken
+            ClientState& client = state.clients.emplace_back();
+            client.fd = fd;
+            ok = nextField(message, field);
+            if (!ok) break;
+            client.slot = std::stoi(field);
+            ok = nextField(message, client.username);
+            if (!ok) break;
+
+            size_t inputLength = 0, outputLength = 0;
+            if (nextField(message, field)) inputLength = std::stoul(field); else ok = false;
+            if (ok && nextField(message, field)) outputLength = std::stoul(field); else ok = false;
+            while (ok && message.size() < inputLength + outputLength) {
+                std::string more;
+                int unexpected = -1;
+                ok = receiveMessage(conn, more, unexpected) && unexpected < 0 && !more.empty();
+                if (unexpected >= 0) close(unexpected);
+                message += more;
+            }
+            ok = ok && message.size() == inputLength + outputLength;
+            if (!ok) break;
+            client.pendingInput = message.substr(0, inputLength);
+            client.pendingOutput = message.substr(inputLength);
+        }
+    } catch (...) {
+        ok = false;
+    }
+
+    // The old process only says DONE once its store and cursors are on disk
+    int unused = -1;
+    ok = ok && sendMessage(conn, "READY") && receiveMessage(conn, message, unused) && message == "DONE";
+    close(conn);
+
+    if (!ok) {
+        std::cerr << "[Upgrade] Incomplete hand-off from the running server\n";
+        if (state.listenFd >= 0) close(state.listenFd);
+        for (const auto& client : state.clients) close(client.fd);
+        return std::nullopt;
+    }
+    return state;
+}
@@ -0,0 +1,214 @@
+#include "IoUring.h"
+
+#ifdef FREIA_HAVE_IO_URING
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+IoUring::~IoUring() {
+    if (bufRing) {
+        io_uring_buf_reg reg{};
+        reg.bgid = bufGroup;
+        syscall(__NR_io_uring_register, ringFd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+        munmap(bufRing, bufRingSize);
+    }
+    delete[] bufMem;
+    if (sqes) munmap(sqes, sqesSize);
+    if (ringMem) munmap(ringMem, ringMemSize);
+    if (ringFd >= 0) close(ringFd);
+}
+
+bool IoUring::init(unsigned entries) {
+    io_uring_params params{};
+    ringFd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+    if (ringFd < 0) return false;
+
+    // Kernels without a single SQ/CQ mapping are older than anything with multishot recv
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) return false;
+
+    size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    ringMemSize = std::max(sqSize, cqSize);
+    ringMem = mmap(nullptr, ringMemSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   ringFd, IORING_OFF_SQ_RING);
+    if (ringMem == MAP_FAILED) {
+        ringMem = nullptr;
+        return false;
+    }
+
+    sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    void* sqeMem = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ringFd, IORING_OFF_SQES);
+    if (sqeMem == MAP_FAILED) return false;
+    sqes = static_cast<io_uring_sqe*>(sqeMem);
+
+    char* base = static_cast<char*>(ringMem);
+    sqHead = reinterpret_cast<unsigned*>(base + params.sq_off.head);
+    sqTail = reinterpret_cast<unsigned*>(base + params.sq_off.tail);
+    sqArray = reinterpret_cast<unsigned*>(base + params.sq_off.array);
+    sqMask = *reinterpret_cast<unsigned*>(base + params.sq_off.ring_mask);
+    sqEntries = params.sq_entries;
+    sqLocalTail = *sqTail;
+
+    cqHead = reinterpret_cast<unsigned*>(base + params.cq_off.head);
+    cqTail = reinterpret_cast<unsigned*>(base + params.cq_off.tail);
+    cqes = reinterpret_cast<io_uring_cqe*>(base + params.cq_off.cqes);
+    cqMask = *reinterpret_cast<unsigned*>(base + params.cq_off.ring_mask);
+    return true;
+}
+
+// count has to be a power of two
+bool IoUring::registerBufferRing(uint16_t groupId, unsigned count, unsigned bufferSize) {
+    bufRingSize = count * sizeof(io_uring_buf);
+    void* mem = mmap(nullptr, bufRingSize, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (mem == MAP_FAILED) return false;
+
+    io_uring_buf_reg reg{};
+    reg.ring_addr = reinterpret_cast<uint64_t>(mem);
+    reg.ring_entries = count;
+    reg.bgid = groupId;
+    if (syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+        munmap(mem, bufRingSize);
+        return false;
+    }
+
+    bufRing = static_cast<io_uring_buf*>(mem);
+    bufMem = new char[static_cast<size_t>(count) * bufferSize];
+    bufCount = count;
+    bufSize = bufferSize;
+    bufGroup = groupId;
+    for (unsigned i = 0; i < count; ++i) recycleBuffer(static_cast<uint16_t>(i));
+    return true;
+}
+
+io_uring_sqe* IoUring::getSqe() {
+    // A full queue is flushed to the kernel first, callers that link SQEs check freeSqes()
+    if (freeSqes() == 0 && submit() < 0) return nullptr;
+    unsigned head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+    if (sqLocalTail - head >= sqEntries) return nullptr;
+
+    unsigned index = sqLocalTail & sqMask;
+    io_uring_sqe* sqe = &sqes[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    sqArray[index] = index;
+    sqLocalTail++;
+    return sqe;
+}
+
+unsigned IoUring::freeSqes() const {
+    return sqEntries - (sqLocalTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE));
+}
+
+bool IoUring::prepAcceptMultishot(int listenFd, uint64_t userData) {
+    io_uring_sqe* sqe = getSqe();
+    if (!sqe) return false;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listenFd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = userData;
+    return true;
+}
+
+bool IoUring::prepRecvMultishot(int fd, uint64_t userData) {
+    io_uring_sqe* sqe = getSqe();
+    if (!sqe) return false;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = bufGroup;
+    sqe->user_data = userData;
+    return true;
+}
+
+bool IoUring::prepSend(int fd, const void* data, size_t length, uint64_t userData, bool linkNext) {
+    io_uring_sqe* sqe = getSqe();
+    if (!sqe) return false;
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(data);
+    sqe->len = static_cast<uint32_t>(length);
+    // WAITALL makes the kernel retry short sends instead of failing the link,
+    // MORE keeps a linked prefix in the same segment as the payload after it
+    sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+    if (linkNext) {
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->msg_flags |= MSG_MORE;
+    }
+    sqe->user_data = userData;
+    return true;
+}
+
+bool IoUring::prepCancel(uint64_t targetUserData, uint64_t userData) {
+    io_uring_sqe* sqe = getSqe();
+    if (!sqe) return false;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = targetUserData;
+    sqe->user_data = userData;
+    return true;
+}
+
+bool IoUring::prepPoll(int fd, uint64_t userData, unsigned events) {
+    io_uring_sqe* sqe = getSqe();
+    if (!sqe) return false;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+    sqe->user_data = userData;
+    return true;
+}
+
+bool IoUring::prepTimeout(const __kernel_timespec* timeout, uint64_t userData) {
+    io_uring_sqe* sqe = getSqe();
+    if (!sqe) return false;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = reinterpret_cast<uint64_t>(timeout);
+    sqe->len = 1;
+    sqe->user_data = userData;
+    return true;
+}
+
+int IoUring::submit(unsigned waitFor) {
+    unsigned toSubmit = sqLocalTail - *sqTail;
+    __atomic_store_n(sqTail, sqLocalTail, __ATOMIC_RELEASE);
+
+    unsigned flags = waitFor ? IORING_ENTER_GETEVENTS : 0;
+    while (true) {
+        long ret = syscall(__NR_io_uring_enter, ringFd, toSubmit, waitFor, flags, nullptr, 0);
+        if (ret >= 0 || errno != EINTR) return static_cast<int>(ret);
+        toSubmit = 0;   // the kernel consumed the SQEs before it was interrupted
+    }
+}
+
+io_uring_cqe* IoUring::peekCqe() {
+    unsigned head = *cqHead;
+    if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) return nullptr;
+    return &cqes[head & cqMask];
+}
+
+void IoUring::seenCqe() {
+    __atomic_store_n(cqHead, *cqHead + 1, __ATOMIC_RELEASE);
+}
+
+const char* IoUring::buffer(uint16_t bufferId) const {
+    return bufMem + static_cast<size_t>(bufferId) * bufSize;
+}
+
+void IoUring::recycleBuffer(uint16_t bufferId) {
+    io_uring_buf& slot = bufRing[bufLocalTail & (bufCount - 1)];
+    slot.addr = reinterpret_cast<uint64_t>(bufMem + static_cast<size_t>(bufferId) * bufSize);
+    slot.len = bufSize;
+    slot.bid = bufferId;
+    bufLocalTail++;
+
+    // The ring tail overlays the resv field of the first entry
+    __atomic_store_n(&bufRing[0].resv, bufLocalTail, __ATOMIC_RELEASE);
+}
+
+#endif
@@ -0,0 +1,62 @@
+#include "MemoryBudget.h"
+#include <iostream>
+#include <limits>
+
+MemoryBudget::Profile MemoryBudget::Profile::lowMemory() {
+    Profile profile;
+    profile.budgetBytes = 16 * 1024 * 1024;
+    profile.sqliteCacheKiB = 256;
+    profile.poolCachedPerClass = 4;
+    profile.poolPreallocatePerClass = 4;
+    profile.arenaBytes = 4 * 1024;
+    profile.streamsPerConnection = 2;
+    profile.orphanedStreams = 32;
+    profile.storedCursors = 4096;
+    profile.remoteUsers = 1000;
+    profile.federationLinks = 2;
+    profile.federationSendBuffer = 256 * 1024;
+    profile.redeemedTickets = 4096;
+    profile.readBytes = 2048;
+    profile.maxChunkBytes = 2048;
+    profile.maxHandshakeBytes = 1024;
+    profile.outboxBytes = 8 * 1024;
+    profile.allowIoUring = false;
+    return profile;
+}
+
+void MemoryBudget::configure(const Profile& profile) {
+    config = profile;
+    fixed = 0;
+    fixedItems.clear();
+}
+
+void MemoryBudget::chargeFixed(const std::string& what, size_t bytes) {
+    fixed += bytes;
+    fixedItems.emplace_back(what, bytes);
+}
+
+bool MemoryBudget::admitConnection(bool force) {
+    if (!force && connectionCount >= connectionCapacity()) return false;
+    connectionCount++;
+    return true;
+}
+
+void MemoryBudget::releaseConnection() {
+    if (connectionCount > 0) connectionCount--;
+}
+
+size_t MemoryBudget::connectionCapacity() const {
+    if (config.budgetBytes == 0 || connectionCost == 0) return std::numeric_limits<size_t>::max();
+    if (fixed >= config.budgetBytes) return 0;
+    return (config.budgetBytes - fixed) / connectionCost;
+}
+
+void MemoryBudget::report() const {
+    std::cout << "[Memory] Fixed " << fixed << " bytes:";
+    for (const auto& [what, bytes] : fixedItems) std::cout << " " << what << " " << bytes << ",";
+    std::cout << " plus " << connectionCost << " bytes per connection\n";
+
+    if (config.budgetBytes == 0) return;
+    std::cout << "[Memory] Budget " << config.budgetBytes << " bytes fits " << connectionCapacity()
+              << " connections\n";
+}
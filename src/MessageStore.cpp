@@ -0,0 +1,391 @@
+#include "MessageStore.h"
+#include <iostream>
+#include <fstream>
+#include <filesystem>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+namespace fs = std::filesystem;
+
+namespace
+{
+    // Sends [offset, offset + length) of a segment, -1 with errno set on failure. Client sockets
+    // are non-blocking from their accept on, so sendfile never waits for room either.
+    ssize_t sendSegmentBytes(int sock, int fd, off_t offset, size_t length)
+    {
+        ssize_t sent;
+        do sent = sendfile(sock, fd, &offset, length); while (sent < 0 && errno == EINTR);
+        if (sent < 0 && (errno == EINVAL || errno == ENOSYS)) {
+            // No zero-copy here, go through a buffer
+            char buffer[16 * 1024];
+            ssize_t got = pread(fd, buffer, std::min(length, sizeof(buffer)), offset);
+            sent = (got <= 0) ? -1 : send(sock, buffer, static_cast<size_t>(got), MSG_NOSIGNAL | MSG_DONTWAIT);
+        }
+        return sent;
+    }
+
+    // Makes a rename in dir durable
+    void syncDirectory(const std::string& dir)
+    {
+        int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0) return;
+        fsync(fd);
+        close(fd);
+    }
+}
+
+MessageStore::MessageStore(const std::string& dirPath, uint64_t segmentBytes, uint64_t maxTotalBytes, time_t maxAgeSeconds)
+    : dir(dirPath), segmentBytes(segmentBytes), maxTotalBytes(maxTotalBytes), maxAgeSeconds(maxAgeSeconds) {
+    if (!openStore()) {
+        std::cerr << "Failed to open offline message store in " << dir << "\n";
+    }
+}
+
+MessageStore::~MessageStore() {
+    flushAndClose();
+}
+
+void MessageStore::flushAndClose() {
+    if (closed) return;
+    if (activeFd >= 0) {
+        fdatasync(activeFd);
+        close(activeFd);
+        activeFd = -1;
+    }
+    saveCursors();
+    if (cursorLogFd >= 0) close(cursorLogFd);
+    cursorLogFd = -1;
+    closed = true;
+}
+
+bool MessageStore::openStore() {
+    std::error_code ec;
+    fs::create_directories(dir, ec);
+    if (ec) return false;
+
+    for (const auto& entry : fs::directory_iterator(dir, ec)) {
+        if (!entry.is_regular_file() || entry.path().extension() != ".seg") continue;
+
+        Segment segment;
+        try {
+            segment.baseOffset = std::stoull(entry.path().stem().string());
+        } catch (...) {
+            continue;
+        }
+        segment.path = entry.path().string();
+
+        struct stat st{};
+        if (stat(segment.path.c_str(), &st) != 0) continue;
+        segment.size = static_cast<uint64_t>(st.st_size);
+        segment.lastWrite = st.st_mtime;
+        segments.push_back(segment);
+    }
+    if (ec) return false;
+
+    std::sort(segments.begin(), segments.end(),
+              [](const Segment& a, const Segment& b) { return a.baseOffset < b.baseOffset; });
+
+    loadCursors();
+
+    if (segments.empty()) return openActiveSegment(0);
+
+    // Only the active segment can end in a torn record after a crash
+    Segment& last = segments.back();
+    uint64_t validSize = recoverSegment(last);
+    if (validSize != last.size) {
+        std::cerr << "[Store] Dropping " << (last.size - validSize)
+                  << " bytes of incomplete record from " << last.path << "\n";
+        if (truncate(last.path.c_str(), static_cast<off_t>(validSize)) != 0) return false;
+        last.size = validSize;
+    }
+
+    activeFd = open(last.path.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+    if (activeFd < 0) return false;
+
+    compact();
+    return true;
+}
+
+bool MessageStore::openActiveSegment(uint64_t baseOffset) {
+    Segment segment;
+    segment.baseOffset = baseOffset;
+    segment.path = segmentPath(baseOffset);
+    segment.lastWrite = time(nullptr);
+
+    activeFd = open(segment.path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (activeFd < 0) return false;
+
+    segments.push_back(segment);
+    return true;
+}
+
+bool MessageStore::rollSegment() {
+    if (activeFd >= 0) {
+        fdatasync(activeFd);
+        close(activeFd);
+        activeFd = -1;
+    }
+    if (!openActiveSegment(endOffset())) return false;
+
+    compact();
+    return true;
+}
+
+// Walks the records of a segment and returns the size up to the last complete one
+uint64_t MessageStore::recoverSegment(const Segment& segment) {
+    if (segment.size == 0) return 0;
+
+    int fd = open(segment.path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+
+    void* map = mmap(nullptr, segment.size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return 0;
+
+    const unsigned char* data = static_cast<const unsigned char*>(map);
+    uint64_t pos = 0;
+    while (pos + sizeof(uint32_t) <= segment.size) {
+        uint32_t lenNet = 0;
+        std::memcpy(&lenNet, data + pos, sizeof(lenNet));
+        uint64_t recordEnd = pos + sizeof(lenNet) + ntohl(lenNet);
+        if (recordEnd > segment.size) break;
+        pos = recordEnd;
+    }
+
+    munmap(map, segment.size);
+    return pos;
+}
+
+bool MessageStore::append(std::string_view frame) {
+    if (activeFd < 0 || frame.empty()) return false;
+
+    Segment& active = segments.back();
+    uint32_t lenNet = htonl(static_cast<uint32_t>(frame.size()));
+    iovec parts[2];
+    parts[0].iov_base = &lenNet;
+    parts[0].iov_len = sizeof(lenNet);
+    parts[1].iov_base = const_cast<char*>(frame.data());
+    parts[1].iov_len = frame.size();
+
+    ssize_t expected = static_cast<ssize_t>(sizeof(lenNet) + frame.size());
+    ssize_t written = writev(activeFd, parts, 2);
+    if (written != expected) {
+        std::cerr << "[Store] Failed to append record (errno=" << errno << ")\n";
+        // Never leave half a record behind, readers rely on clean boundaries
+        if (ftruncate(activeFd, static_cast<off_t>(active.size)) != 0) {
+            std::cerr << "[Store] Failed to roll back partial record\n";
+        }
+        return false;
+    }
+
+    active.size += static_cast<uint64_t>(written);
+    active.lastWrite = time(nullptr);
+
+    if (active.size >= segmentBytes) return rollSegment();
+    return true;
+}
+
+uint64_t MessageStore::endOffset() const {
+    if (segments.empty()) return 0;
+    return segments.back().baseOffset + segments.back().size;
+}
+
+void MessageStore::setCursor(const std::string& username, uint64_t offset) {
+    if (closed) return;
+    if (cursors.insert_or_assign(username, offset).second) trimCursors(username);
+
+    // Rewriting every cursor on each disconnect is O(users), appending one line is not
+    std::string line = std::to_string(offset) + ' ' + username + '\n';
+    if (cursorLogFd < 0 || write(cursorLogFd, line.data(), line.size()) != static_cast<ssize_t>(line.size())) {
+        saveCursors();
+        return;
+    }
+    if (++cursorLogLines > 2 * cursors.size() + 1024) saveCursors();
+}
+
+std::optional<uint64_t> MessageStore::getCursor(const std::string& username) const {
+    auto it = cursors.find(username);
+    if (it == cursors.end()) return std::nullopt;
+    return it->second;
+}
+
+void MessageStore::setMaxCursors(size_t count) {
+    maxCursors = count;
+    if (trimCursors() && !closed) saveCursors();
+}
+
+// Usernames are only claimed on PROT2, so anyone can add cursors. The one furthest behind
+// belongs to the user that has been away longest, it gets no backlog if it comes back.
+// Returns whether any cursor was dropped, the file keeps them until it is rewritten.
+bool MessageStore::trimCursors(const std::string& keep) {
+    if (maxCursors == 0 || cursors.size() <= maxCursors) return false;
+
+    std::vector<std::unordered_map<std::string, uint64_t>::iterator> candidates;
+    for (auto it = cursors.begin(); it != cursors.end(); ++it) {
+        if (it->first != keep) candidates.push_back(it);
+    }
+    size_t excess = std::min(cursors.size() - maxCursors, candidates.size());
+    std::nth_element(candidates.begin(), candidates.begin() + excess, candidates.end(),
+                     [](const auto& a, const auto& b) { return a->second < b->second; });
+    for (size_t i = 0; i < excess; ++i) cursors.erase(candidates[i]);
+    return excess > 0;
+}
+
+std::optional<MessageStore::Delivery> MessageStore::beginBacklog(const std::string& username) {
+    auto cursor = getCursor(username);
+    if (!cursor || segments.empty()) return std::nullopt;
+
+    // Anything older than the first segment has been compacted away
+    Delivery delivery;
+    delivery.offset = std::max(*cursor, segments.front().baseOffset);
+    delivery.recordEnd = delivery.offset;
+    uint64_t end = endOffset();
+    if (delivery.offset >= end) return std::nullopt;
+
+    std::cout << "[Store] Delivering " << (end - delivery.offset) << " bytes of backlog to " << username << "\n";
+    return delivery;
+}
+
+MessageStore::Progress MessageStore::continueBacklog(int sock, Delivery& delivery, size_t maxBytes) {
+    while (maxBytes > 0)
+    {
+        // Between records the delivery skips whatever was compacted away meanwhile
+        if (!delivery.midRecord()) {
+            if (segments.empty() || delivery.offset >= endOffset()) return Progress::Done;
+            if (delivery.offset < segments.front().baseOffset)
+                delivery.offset = delivery.recordEnd = segments.front().baseOffset;
+        }
+        const Segment* segment = segmentFor(delivery.offset);
+        if (!segment) return Progress::Failed;      // compacted under a half sent record
+
+        int fd = open(segment->path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return Progress::Failed;
+
+        uint64_t inSegment = delivery.offset - segment->baseOffset;
+        size_t length = static_cast<size_t>(std::min<uint64_t>(maxBytes, segment->size - inSegment));
+        ssize_t sent = sendSegmentBytes(sock, fd, static_cast<off_t>(inSegment), length);
+        if (sent < 0) {
+            bool full = errno == EAGAIN || errno == EWOULDBLOCK;
+            close(fd);
+            return full ? Progress::More : Progress::Failed;
+        }
+
+        // Follow the record headers, records never span segments
+        delivery.offset += static_cast<uint64_t>(sent);
+        maxBytes -= static_cast<size_t>(sent);
+        while (delivery.recordEnd < delivery.offset) {
+            uint32_t lenNet = 0;
+            off_t header = static_cast<off_t>(delivery.recordEnd - segment->baseOffset);
+            if (pread(fd, &lenNet, sizeof(lenNet), header) != sizeof(lenNet)) {
+                close(fd);
+                return Progress::Failed;
+            }
+            delivery.recordStart = delivery.recordEnd;
+            delivery.recordEnd += sizeof(lenNet) + ntohl(lenNet);
+        }
+        close(fd);
+
+        if (static_cast<size_t>(sent) < length) return Progress::More;   // socket buffer is full
+    }
+    return (!delivery.midRecord() && delivery.offset >= endOffset()) ? Progress::Done : Progress::More;
+}
+
+std::optional<std::string> MessageStore::recordRest(const Delivery& delivery) const {
+    if (!delivery.midRecord()) return std::string();
+    const Segment* segment = segmentFor(delivery.offset);
+    if (!segment) return std::nullopt;
+
+    int fd = open(segment->path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return std::nullopt;
+    std::string rest(delivery.recordEnd - delivery.offset, '\0');
+    bool ok = pread(fd, rest.data(), rest.size(), static_cast<off_t>(delivery.offset - segment->baseOffset)) ==
+              static_cast<ssize_t>(rest.size());
+    close(fd);
+    if (!ok) return std::nullopt;
+    return rest;
+}
+
+const MessageStore::Segment* MessageStore::segmentFor(uint64_t offset) const {
+    for (const auto& segment : segments) {
+        if (offset >= segment.baseOffset && offset < segment.baseOffset + segment.size) return &segment;
+    }
+    return nullptr;
+}
+
+void MessageStore::compact() {
+    uint64_t total = 0;
+    for (const auto& segment : segments) total += segment.size;
+
+    time_t now = time(nullptr);
+    // The active segment is never removed
+    while (segments.size() > 1) {
+        const Segment& oldest = segments.front();
+        bool tooBig = total > maxTotalBytes;
+        bool tooOld = now - oldest.lastWrite > maxAgeSeconds;
+        if (!tooBig && !tooOld) break;
+
+        std::cout << "[Store] Compacting segment " << oldest.path
+                  << " (" << oldest.size << " bytes)\n";
+        unlink(oldest.path.c_str());
+        total -= oldest.size;
+        segments.erase(segments.begin());
+    }
+}
+
+std::string MessageStore::segmentPath(uint64_t baseOffset) const {
+    std::string name = std::to_string(baseOffset);
+    name.insert(0, 20 - std::min<size_t>(20, name.size()), '0');
+    return (fs::path(dir) / (name + ".seg")).string();
+}
+
+void MessageStore::loadCursors() {
+    std::ifstream in(fs::path(dir) / "cursors");
+    uint64_t offset = 0;
+    std::string username;
+    // One "<offset> <username>" per line, usernames never contain newlines
+    // Later lines win, the file is a snapshot followed by appended changes
+    while (in >> offset && in.get() == ' ' && std::getline(in, username)) {
+        if (!username.empty()) cursors[username] = offset;
+        cursorLogLines++;
+    }
+    if (cursorLogLines > cursors.size()) saveCursors();
+    else cursorLogFd = open((fs::path(dir) / "cursors").c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+}
+
+void MessageStore::saveCursors() {
+    fs::path finalPath = fs::path(dir) / "cursors";
+    fs::path tmpPath = fs::path(dir) / "cursors.tmp";
+    std::string snapshot;
+    for (const auto& [username, offset] : cursors) {
+        snapshot += std::to_string(offset) + ' ' + username + '\n';
+    }
+
+    // The snapshot is on disk before it replaces the old one and the rename before anything is
+    // appended to it, a crash leaves one of the two complete
+    int fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) return;
+    bool written = write(fd, snapshot.data(), snapshot.size()) == static_cast<ssize_t>(snapshot.size()) &&
+                   fdatasync(fd) == 0;
+    close(fd);
+    std::error_code ec;
+    if (written) fs::rename(tmpPath, finalPath, ec);
+    if (!written || ec) {
+        std::cerr << "[Store] Failed to save delivery cursors\n";
+        return;
+    }
+    syncDirectory(dir);
+
+    // Appends go to the fresh snapshot from now on
+    if (cursorLogFd >= 0) close(cursorLogFd);
+    cursorLogFd = closed ? -1 : open(finalPath.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+    cursorLogLines = cursors.size();
+}
@@ -0,0 +1,120 @@
+#include "SessionTickets.h"
+#include "FreiaEncryption.h"
+#include <cstring>
+#include <sstream>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+
+namespace
+{
+    constexpr size_t MAC_SIZE = 32;
+    constexpr size_t MIN_CIPHERTEXT_SIZE = 32;      // IV plus one block
+
+    void mac(const SessionTickets::Keys& keys, std::string_view data, unsigned char* out)
+    {
+        unsigned int length = MAC_SIZE;
+        HMAC(EVP_sha256(), keys.data() + 32, 32,
+             reinterpret_cast<const unsigned char*>(data.data()), data.size(), out, &length);
+    }
+
+    FreiaEncryption::Key encryptionKey(const SessionTickets::Keys& keys)
+    {
+        FreiaEncryption::Key key{};
+        std::memcpy(key.data(), keys.data(), key.size());
+        return key;
+    }
+}
+
+SessionTickets::SessionTickets() {
+    RAND_bytes(ticketKeys.data(), static_cast<int>(ticketKeys.size()));
+}
+
+std::string SessionTickets::issue(const std::string& username, uint64_t cursor) {
+    uint64_t id = 0;
+    if (RAND_bytes(reinterpret_cast<unsigned char*>(&id), sizeof(id)) != 1) return "";
+
+    time_t expires = time(nullptr) + LIFETIME_SECONDS;
+    std::string plain = std::to_string(id) + "\n" + username + "\n" +
+                        std::to_string(static_cast<long long>(expires)) + "\n" + std::to_string(cursor);
+
+    std::string sealed(plain.size() + 32 + MAC_SIZE, '\0');
+    size_t length = FreiaEncryption::encryptInto(plain, encryptionKey(ticketKeys), sealed.data(), sealed.size());
+    if (length == 0) return "";
+    mac(ticketKeys, std::string_view(sealed.data(), length), reinterpret_cast<unsigned char*>(sealed.data() + length));
+    sealed.resize(length + MAC_SIZE);
+    return FreiaEncryption::base64_encode(sealed);
+}
+
+std::optional<SessionTickets::Ticket> SessionTickets::redeem(std::string_view ticket, std::string_view username) {
+    std::string sealed = FreiaEncryption::base64_decode(std::string(ticket));
+    if (sealed.size() < MIN_CIPHERTEXT_SIZE + MAC_SIZE) return std::nullopt;
+
+    std::string_view ciphertext(sealed.data(), sealed.size() - MAC_SIZE);
+    unsigned char expected[MAC_SIZE];
+    mac(ticketKeys, ciphertext, expected);
+    if (CRYPTO_memcmp(expected, sealed.data() + ciphertext.size(), MAC_SIZE) != 0) return std::nullopt;
+
+    std::string plain(ciphertext.size(), '\0');
+    size_t length = FreiaEncryption::decryptInto(ciphertext, encryptionKey(ticketKeys), plain.data(), plain.size());
+    if (length == 0) return std::nullopt;
+    plain.resize(length);
+
+    // id, username, expiry, cursor
+    std::string fields[4];
+    size_t start = 0;
+    for (int i = 0; i < 4; ++i) {
+        size_t end = (i < 3) ? plain.find('\n', start) : plain.size();
+        if (end == std::string::npos) return std::nullopt;
+        fields[i] = plain.substr(start, end - start);
+        start = end + 1;
+    }
+
+    Ticket result;
+    uint64_t id = 0;
+    try {
+        id = std::stoull(fields[0]);
+        result.expires = static_cast<time_t>(std::stoll(fields[2]));
+        result.cursor = std::stoull(fields[3]);
+    } catch (...) {
+        return std::nullopt;
+    }
+    result.username = fields[1];
+    if (result.username != username) return std::nullopt;
+
+    time_t now = time(nullptr);
+    if (result.expires <= now) return std::nullopt;
+    forgetExpired(now);
+    if (maxRedeemed > 0 && redeemed.size() >= maxRedeemed) return std::nullopt;
+    if (!redeemed.insert(id).second) return std::nullopt;
+    redeemedByExpiry.emplace(result.expires, id);
+    return result;
+}
+
+std::string SessionTickets::exportRedeemed() const {
+    time_t now = time(nullptr);
+    std::string lines;
+    for (const auto& [expires, id] : redeemedByExpiry) {
+        if (expires > now) lines += std::to_string(id) + ' ' + std::to_string(expires) + '\n';
+    }
+    return lines;
+}
+
+void SessionTickets::importRedeemed(std::string_view lines) {
+    std::istringstream in{std::string(lines)};
+    uint64_t id = 0;
+    long long expires = 0;
+    while (in >> id >> expires) {
+        if (redeemed.insert(id).second) redeemedByExpiry.emplace(static_cast<time_t>(expires), id);
+    }
+    forgetExpired(time(nullptr));
+}
+
+// Only the ids in front can have expired, the rest is never looked at
+void SessionTickets::forgetExpired(time_t now) {
+    while (!redeemedByExpiry.empty() && redeemedByExpiry.begin()->first <= now) {
+        redeemed.erase(redeemedByExpiry.begin()->second);
+        redeemedByExpiry.erase(redeemedByExpiry.begin());
+    }
+}
@@ -0,0 +1,61 @@
+#include "TcpTuning.h"
+#include <algorithm>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+namespace
+{
+    void setOption(int fd, int level, int name, int value)
+    {
+        setsockopt(fd, level, name, &value, sizeof(value));
+    }
+}
+
+void TcpTuning::applyToListener(int fd) const
+{
+    if (policy.sendBufferBytes > 0) setOption(fd, SOL_SOCKET, SO_SNDBUF, policy.sendBufferBytes);
+    if (policy.receiveBufferBytes > 0) setOption(fd, SOL_SOCKET, SO_RCVBUF, policy.receiveBufferBytes);
+}
+
+void TcpTuning::applyToClient(int fd) const
+{
+    applyToListener(fd);
+    setOption(fd, IPPROTO_TCP, TCP_NODELAY, policy.mode == Mode::Latency ? 1 : 0);
+    setOption(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, static_cast<int>(policy.userTimeoutMs));
+
+    setOption(fd, SOL_SOCKET, SO_KEEPALIVE, policy.keepAliveIdleSeconds > 0 ? 1 : 0);
+    if (policy.keepAliveIdleSeconds > 0) {
+        setOption(fd, IPPROTO_TCP, TCP_KEEPIDLE, policy.keepAliveIdleSeconds);
+        setOption(fd, IPPROTO_TCP, TCP_KEEPINTVL, policy.keepAliveIntervalSeconds);
+        setOption(fd, IPPROTO_TCP, TCP_KEEPCNT, policy.keepAliveCount);
+    }
+}
+
+void TcpTuning::beforeWrite(int fd)
+{
+    if (policy.mode != Mode::Throughput || fd <= 0) return;
+
+    // A single frame goes out as is, only a second one in the same iteration is worth a cork
+    unsigned writes = ++writesThisIteration[fd];
+    if (writes == 2) {
+        setOption(fd, IPPROTO_TCP, TCP_CORK, 1);
+        corked.push_back(fd);
+        counters.corkedBursts++;
+        counters.coalescedFrames++;
+    }
+    if (writes >= 2) counters.coalescedFrames++;
+}
+
+void TcpTuning::forget(int fd)
+{
+    writesThisIteration.erase(fd);
+    corked.erase(std::remove(corked.begin(), corked.end(), fd), corked.end());
+}
+
+void TcpTuning::flush()
+{
+    for (int fd : corked) setOption(fd, IPPROTO_TCP, TCP_CORK, 0);
+    corked.clear();
+    if (!writesThisIteration.empty()) writesThisIteration.clear();
+}
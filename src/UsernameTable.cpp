@@ -0,0 +1,58 @@
+#include "UsernameTable.h"
+#include <cstring>
+
+UsernameTable::UsernameTable(size_t capacity) {
+    reserve(capacity);
+}
+
+// Only valid while the table is empty, the index points into the entries
+void UsernameTable::reserve(size_t capacity) {
+    if (!index.empty()) return;
+    entries.assign(capacity, Entry{});
+    freeIds.clear();
+    freeIds.reserve(capacity);
+    for (size_t i = capacity; i > 0; --i) freeIds.push_back(static_cast<uint32_t>(i));
+    index.reserve(capacity);
+}
+
+uint32_t UsernameTable::intern(std::string_view name) {
+    if (name.empty() || name.size() > MAX_LENGTH) return NONE;
+
+    auto it = index.find(name);
+    if (it != index.end()) {
+        entries[it->second - 1].refs++;
+        return it->second;
+    }
+    if (freeIds.empty()) return NONE;
+
+    uint32_t id = freeIds.back();
+    freeIds.pop_back();
+    Entry& entry = entries[id - 1];
+    std::memcpy(entry.text, name.data(), name.size());
+    entry.length = static_cast<uint8_t>(name.size());
+    entry.refs = 1;
+    index.emplace(std::string_view(entry.text, entry.length), id);
+    return id;
+}
+
+void UsernameTable::release(uint32_t id) {
+    if (id == NONE || id > entries.size()) return;
+    Entry& entry = entries[id - 1];
+    if (entry.refs == 0 || --entry.refs > 0) return;
+
+    index.erase(std::string_view(entry.text, entry.length));
+    entry.length = 0;
+    freeIds.push_back(id);
+}
+
+std::string_view UsernameTable::name(uint32_t id) const {
+    if (id == NONE || id > entries.size()) return {};
+    const Entry& entry = entries[id - 1];
+    return std::string_view(entry.text, entry.length);
+}
+
+// Entries plus a rough figure for the index (one node and one bucket per entry)
+size_t UsernameTable::bytes() const {
+    return entries.capacity() * sizeof(Entry) + freeIds.capacity() * sizeof(uint32_t) +
+           entries.capacity() * (sizeof(std::pair<std::string_view, uint32_t>) + 2 * sizeof(void*));
+}
@@ -1,11 +1,128 @@
 #include <iostream>
 #include <string>
+#include <vector>
+#include <thread>
+#include <cstdio>
+#include <csignal>
+#include <sys/stat.h>
 #include "server.h"
 #include "FreiaEncryption.h"
+#include "HotRestart.h"
+#include "Federation.h"
 
-int main()
+// Several federated nodes in one process, to try federation on a single machine.
+// Node i serves clients on port + i, peers on federationPort + i and keeps its data in node<i>/
+static void runLocalNodes(int nodes, int port, int maxClients, const std::string& password,
+                          int federationPort, bool useIoUring, const TcpTuning::Policy& tcpPolicy,
+                          const MemoryBudget::Profile& memoryProfile)
+{
+    std::vector<std::thread> threads;
+    for (int i = 0; i < nodes; ++i) {
+        threads.emplace_back([=]() {
+            std::string dataDir = "node" + std::to_string(i) + "/";
+            mkdir(dataDir.c_str(), 0700);
+
+            Federation::Config config;
+            config.nodeId = "node" + std::to_string(i);
+            config.port = federationPort + i;
+            for (int j = 0; j < i; ++j)
+                config.peers.push_back("127.0.0.1:" + std::to_string(federationPort + j));
+
+            Server server(port + i, maxClients, password, useIoUring, dataDir);
+            server.setMemoryProfile(memoryProfile);
+            server.setTcpPolicy(tcpPolicy);
+            server.enableFederation(config);
+            server.run();
+        });
+    }
+    for (auto& thread : threads) thread.join();
+}
+
+int main(int argc, char* argv[])
 {
     std::cout << "Freia Thiwi v" << PROJECT_VERSION << "\n";
+    // Backlogs are written with sendfile, which has no MSG_NOSIGNAL
+    signal(SIGPIPE, SIG_IGN);
+
+    bool useIoUring = false;
+    bool upgrade = false;
+    std::string dataDir;
+    Federation::Config federationConfig;
+    int localNodes = 0;
+    TcpTuning::Policy tcpPolicy;
+#ifdef FREIA_LOW_MEMORY
+    MemoryBudget::Profile memoryProfile = MemoryBudget::Profile::lowMemory();
+#else
+    MemoryBudget::Profile memoryProfile;
+#endif
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--io-uring") {
+            useIoUring = true;
+        } else if (arg == "--upgrade") {
+            upgrade = true;
+        } else if (arg == "--data-dir" && hasValue) {
+            dataDir = argv[++i];
+        } else if (arg == "--node-id" && hasValue) {
+            federationConfig.nodeId = argv[++i];
+        } else if (arg == "--federation-port" && hasValue) {
+            federationConfig.port = std::atoi(argv[++i]);
+        } else if (arg == "--peer" && hasValue) {
+            federationConfig.peers.push_back(argv[++i]);
+        } else if (arg == "--local-nodes" && hasValue) {
+            localNodes = std::atoi(argv[++i]);
+        } else if (arg == "--tcp-mode" && hasValue && (std::string(argv[i + 1]) == "latency" ||
+                                                      std::string(argv[i + 1]) == "throughput")) {
+            tcpPolicy.mode = std::string(argv[++i]) == "latency" ? TcpTuning::Mode::Latency
+                                                                 : TcpTuning::Mode::Throughput;
+        } else if (arg == "--low-memory") {
+            memoryProfile = MemoryBudget::Profile::lowMemory();
+        } else if (arg == "--memory-budget" && hasValue) {
+            memoryProfile.budgetBytes = static_cast<size_t>(std::atoi(argv[++i])) * 1024 * 1024;
+        } else if (arg == "--tcp-sndbuf" && hasValue) {
+            tcpPolicy.sendBufferBytes = std::atoi(argv[++i]);
+        } else if (arg == "--tcp-rcvbuf" && hasValue) {
+            tcpPolicy.receiveBufferBytes = std::atoi(argv[++i]);
+        } else if (arg == "--tcp-user-timeout" && hasValue) {
+            tcpPolicy.userTimeoutMs = static_cast<unsigned>(std::atoi(argv[++i]));
+        } else if (arg == "--tcp-keepalive" && hasValue &&
+                   std::sscanf(argv[i + 1], "%d:%d:%d", &tcpPolicy.keepAliveIdleSeconds,
+                               &tcpPolicy.keepAliveIntervalSeconds, &tcpPolicy.keepAliveCount) >= 1) {
+            ++i;
+        } else {
+            std::cerr << "Unknown option: " << arg << "\n";
+            std::cerr << "Usage: freia-thiwi [--io-uring] [--upgrade] [--data-dir DIR]\n"
+                      << "                   [--node-id ID] [--federation-port PORT] [--peer HOST:PORT]...\n"
+                      << "                   [--local-nodes N]\n"
+                      << "                   [--tcp-mode latency|throughput] [--tcp-sndbuf BYTES] [--tcp-rcvbuf BYTES]\n"
+                      << "                   [--tcp-user-timeout MS] [--tcp-keepalive IDLE[:INTERVAL:COUNT]]\n"
+                      << "                   [--low-memory] [--memory-budget MB]\n";
+            return 1;
+        }
+    }
+
+    if (!dataDir.empty()) {
+        mkdir(dataDir.c_str(), 0700);
+        if (dataDir.back() != '/') dataDir += '/';
+    }
+    bool federated = federationConfig.port > 0 || !federationConfig.peers.empty();
+
+    // Hot restart: take over sockets and clients from the running server, no prompts
+    if (upgrade) {
+        auto state = HotRestart::receiveState(dataDir + HotRestart::socketPath);
+        if (!state) return 1;
+
+        Server server(*state, useIoUring, dataDir);
+        server.setMemoryProfile(memoryProfile);
+        server.setTcpPolicy(tcpPolicy);
+        if (federated) {
+            if (federationConfig.nodeId.empty()) federationConfig.nodeId = "node-" + std::to_string(state->port);
+            server.enableFederation(federationConfig);
+        }
+        server.run();
+        return 0;
+    }
     
     int PORT;
     int maxClients;
@@ -33,8 +150,20 @@ int main()
         return 1;
     }
 
-    Server server(PORT, maxClients, serverPassword);
+    if (localNodes > 0) {
+        int federationPort = federationConfig.port > 0 ? federationConfig.port : PORT + 100;
+        runLocalNodes(localNodes, PORT, maxClients, serverPassword, federationPort, useIoUring, tcpPolicy, memoryProfile);
+        return 0;
+    }
+
+    Server server(PORT, maxClients, serverPassword, useIoUring, dataDir);
+    server.setMemoryProfile(memoryProfile);
+    server.setTcpPolicy(tcpPolicy);
+    if (federated) {
+        if (federationConfig.nodeId.empty()) federationConfig.nodeId = "node-" + std::to_string(PORT);
+        server.enableFederation(federationConfig);
+    }
     server.run();
 
     return 0;
-}
\ No newline at end of file
+}
@@ -1,14 +1,211 @@
 #include "server.h"
+#include <algorithm>
+#include <fstream>
+#include <fcntl.h>
 
-Server::Server(int port, int maxClients, const std::string& password)
-    : maxClients(maxClients), PORT(port), serverPassword(password), accountsDb("accounts.db") {
+namespace
+{
+    // Client sockets never block the loop, what does not fit is queued (see queueOutput)
+    void setNonBlocking(int fd)
+    {
+        int flags = fcntl(fd, F_GETFL);
+        if (flags >= 0 && !(flags & O_NONBLOCK)) fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    }
+
+    size_t residentBytes()
+    {
+        std::ifstream statm("/proc/self/statm");
+        size_t pages = 0, resident = 0;
+        statm >> pages >> resident;
+        return resident * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    }
+
+    // A stream with its owner's name and the entry of one receiver
+    constexpr size_t STREAM_STATE_BYTES = MemoryBudget::entryBytes<std::unordered_map<uint32_t, FileRelay::Stream>>() +
+                                          UsernameTable::MAX_LENGTH +
+                                          MemoryBudget::entryBytes<decltype(FileRelay::Stream::receivers)>();
+    // A delivery cursor of a user that is offline
+    constexpr size_t CURSOR_BYTES = MemoryBudget::entryBytes<std::unordered_map<std::string, uint64_t>>() +
+                                    UsernameTable::MAX_LENGTH;
+
+    // libstdc++ gives even an empty deque one element block and a map of 8 block pointers
+    constexpr size_t DEQUE_BLOCK_BYTES = 512;
+    constexpr size_t DEQUE_EMPTY_BYTES = DEQUE_BLOCK_BYTES + 8 * sizeof(void*);
+}
+
+Server::Server(int port, int maxClients, const std::string& password, bool useIoUring,
+               const std::string& dataDir)
+    : maxClients(maxClients), PORT(port), serverPassword(password), accountsDb(dataDir + "accounts.db"),
+      offlineStore(dataDir + "freia_store"), useIoUring(useIoUring) {
         serverKey = FreiaEncryption::deriveKey(serverPassword);
         masterSocket = initializeServerSocket();
         clientSocket.assign(maxClients, 0);
+        clientUsername.assign(maxClients, UsernameTable::NONE);
+        usernames.reserve(maxClients);
         addrlen = sizeof(address);
+        upgradeSocket = HotRestart::listenForUpgrade(dataDir + HotRestart::socketPath);
         std::cout << "Waiting for connections ... \n";
 }
 
+// Takes over from a running server, see HotRestart.h
+Server::Server(const HotRestart::State& state, bool useIoUring, const std::string& dataDir)
+    : maxClients(state.maxClients), PORT(state.port), accountsDb(dataDir + "accounts.db"),
+      offlineStore(dataDir + "freia_store"), useIoUring(useIoUring) {
+        serverKey = state.serverKey;
+        masterSocket = state.listenFd;
+        // Tickets handed out by the old process stay valid
+        SessionTickets::Keys keys;
+        if (state.ticketKeys.size() == keys.size()) {
+            std::memcpy(keys.data(), state.ticketKeys.data(), keys.size());
+            tickets.setKeys(keys);
+        }
+        tickets.importRedeemed(state.redeemedTickets);
+        clientSocket.assign(maxClients, 0);
+        clientUsername.assign(maxClients, UsernameTable::NONE);
+        usernames.reserve(maxClients);
+        addrlen = sizeof(address);
+        for (const auto& client : state.clients) {
+            setNonBlocking(client.fd);
+            if (client.slot < 0 && client.username.empty()) {
+                memoryBudget.admitConnection(true);
+                handshakes[client.fd] = time(nullptr) + HANDSHAKE_TIMEOUT_SECONDS;
+                if (!client.pendingInput.empty()) inboxes[client.fd] = client.pendingInput;
+                continue;
+            }
+            if (client.slot < 0 || client.slot >= maxClients || clientSocket[client.slot] != 0) {
+                close(client.fd);
+                continue;
+            }
+            clientSocket[client.slot] = client.fd;
+            clientUsername[client.slot] = usernames.intern(client.username);
+            memoryBudget.admitConnection(true);
+            // The old process left the cursor where its backlog delivery stopped
+            if (auto delivery = offlineStore.beginBacklog(client.username)) backlogs[client.fd] = *delivery;
+            if (!client.pendingInput.empty()) inboxes[client.fd] = client.pendingInput;
+            // Owed from before the takeover, sent ahead of the backlog
+            if (!client.pendingOutput.empty()) queueOutput(client.fd, {}, client.pendingOutput);
+        }
+        upgradeSocket = HotRestart::listenForUpgrade(dataDir + HotRestart::socketPath);
+        std::cout << "Took over " << state.clients.size() << " clients on port " << PORT << "\n";
+}
+
+// Joins the other nodes, users already connected here are announced to them
+void Server::enableFederation(const Federation::Config& config)
+{
+    Federation::Config limited = config;
+    limited.maxRemoteUsers = memoryBudget.profile().remoteUsers;
+    limited.maxLinks = memoryBudget.profile().federationLinks;
+    limited.sendBufferBytes = memoryBudget.profile().federationSendBuffer;
+    memoryBudget.chargeFixed("remote users", limited.maxRemoteUsers * Federation::REMOTE_USER_BYTES);
+    memoryBudget.chargeFixed("federation links", Federation::bufferBytes(limited));
+    std::cout << "[Memory] Remote users " << limited.maxRemoteUsers * Federation::REMOTE_USER_BYTES
+              << " bytes, links " << Federation::bufferBytes(limited) << " bytes";
+    if (memoryBudget.profile().budgetBytes > 0)
+        std::cout << ", budget fits " << memoryBudget.connectionCapacity() << " connections";
+    std::cout << "\n";
+
+    if (!federation.start(limited, serverKey))
+        handleSystemCallError("Failed to start federation");
+    for (int i = 0; i < maxClients; ++i) {
+        if (clientUsername[i] != UsernameTable::NONE) federation.userJoined(std::string(usernameOf(i)));
+    }
+    federationRetry = federation.maintain();
+}
+
+void Server::setTcpPolicy(const TcpTuning::Policy& policy)
+{
+    tcpTuning.setPolicy(policy);
+    tcpTuning.applyToListener(masterSocket);
+    for (int i = 0; i < maxClients; ++i) {
+        if (clientSocket[i] > 0) tcpTuning.applyToClient(clientSocket[i]);
+    }
+}
+
+// Applies a memory profile and works out the worst case of a connection, see MemoryBudget.h
+void Server::setMemoryProfile(const MemoryBudget::Profile& profile)
+{
+    memoryBudget.configure(profile);
+    framePool.setMaxCachedPerClass(profile.poolCachedPerClass);
+    framePool.preallocate(profile.poolPreallocatePerClass, 4096);
+    frameArena.resize(profile.arenaBytes);
+    if (profile.sqliteCacheKiB > 0) accountsDb.setCacheSize(profile.sqliteCacheKiB);
+    fileRelay.setMaxStreamsPerSocket(profile.streamsPerConnection);
+    readBytes = profile.readBytes;
+    maxChunkBytes = static_cast<uint32_t>(std::min<size_t>(profile.maxChunkBytes, FileRelay::MAX_CHUNK_SIZE));
+    maxHandshakeBytes = static_cast<uint32_t>(profile.maxHandshakeBytes);
+    outboxLimitBytes = profile.outboxBytes;
+    if (useIoUring && !profile.allowIoUring) {
+        std::cout << "io_uring does not fit the memory profile, using select\n";
+        useIoUring = false;
+    }
+
+    memoryBudget.chargeFixed("server", sizeof(Server));
+    memoryBudget.chargeFixed("slots", maxClients * (sizeof(int) + sizeof(uint32_t)) + usernames.bytes());
+    memoryBudget.chargeFixed("frame pool", framePool.cacheLimitBytes());
+    memoryBudget.chargeFixed("arena", frameArena.capacityBytes());
+    memoryBudget.chargeFixed("sqlite cache", static_cast<size_t>(profile.sqliteCacheKiB > 0 ? profile.sqliteCacheKiB : 2000) * 1024);
+
+    fileRelay.setMaxOrphanedStreams(profile.orphanedStreams);
+    memoryBudget.chargeFixed("orphaned streams", profile.orphanedStreams * STREAM_STATE_BYTES);
+    offlineStore.setMaxCursors(profile.storedCursors);
+    memoryBudget.chargeFixed("cursors", profile.storedCursors * CURSOR_BYTES);
+    tickets.setMaxRedeemed(profile.redeemedTickets);
+    memoryBudget.chargeFixed("redeemed tickets", profile.redeemedTickets * SessionTickets::redeemedEntryBytes());
+    // Frame buffers taken from the pool while one frame is handled: the read, its plaintext and a reply
+    memoryBudget.chargeFixed("frames in use", BufferPool::capacityFor(readBytes) +
+                                              2 * BufferPool::capacityFor(maxFrameBytes()));
+
+    // What one connection can add on top of its preallocated slot: its entries in the maps keyed by
+    // its socket, its place in failedSockets, its presence and the streams it sends or receives
+    const size_t connectionState =
+        MemoryBudget::entryBytes<decltype(handshakes)>() + MemoryBudget::entryBytes<decltype(backlogs)>() +
+        MemoryBudget::entryBytes<decltype(inboxes)>() + MemoryBudget::entryBytes<decltype(outboxes)>() +
+        2 * sizeof(int) + FileRelay::socketBytes() + TcpTuning::socketBytes() + Federation::localUserBytes() +
+        std::max<size_t>(profile.streamsPerConnection, 1) * STREAM_STATE_BYTES;
+    // Queued frames hold their pooled buffers and deque entries to the outbox limit, the deque
+    // adds its first block and a partly used last one
+    size_t outputBytes = outboxLimitBytes + DEQUE_EMPTY_BYTES + DEQUE_BLOCK_BYTES;
+    // An inbox is rebuilt at its exact size on every read, see readClientInput
+    size_t inputBytes = readBytes + maxFrameBytes();
+#ifdef FREIA_HAVE_IO_URING
+    if (useIoUring) {
+        memoryBudget.chargeFixed("io_uring buffers", RING_READ_BYTES);
+        // Ring inboxes are appended to and can take twice what they hold. A send in flight keeps its
+        // payload and make_shared's control block, fanOutIoUring keeps payloads to the outbox limit.
+        inputBytes = MemoryBudget::entryBytes<decltype(ringConnections)>() + 2 * (RING_READ_BYTES + maxFrameBytes());
+        outputBytes += MemoryBudget::entryBytes<decltype(ringSends)>() + sizeof(PooledBuffer) + 2 * sizeof(void*) +
+                       outboxLimitBytes;
+    }
+#endif
+    memoryBudget.setConnectionCost(connectionState + outputBytes + inputBytes);
+    memoryBudget.report();
+    if (profile.budgetBytes > 0 && static_cast<size_t>(maxClients) > memoryBudget.connectionCapacity())
+        std::cout << "[Memory] Max clients " << maxClients << " is above what the budget fits\n";
+
+    baselineRssBytes = residentBytes();
+}
+
+// A handshake, a PROT frame or a file chunk, whichever the profile lets be the largest
+size_t Server::maxFrameBytes() const
+{
+    return sizeof(uint32_t) + std::max<size_t>({maxHandshakeBytes, MAX_PACKET_SIZE,
+                                                FileRelay::CHUNK_HEADER_SIZE + maxChunkBytes});
+}
+
+std::string_view Server::usernameOf(int slot) const
+{
+    std::string_view name = usernames.name(clientUsername[slot]);
+    return name.empty() ? std::string_view("Unknown") : name;
+}
+
+// inet_ntoa returns a static buffer, servers of --local-nodes run in threads
+std::string Server::ipOf(const sockaddr_in& addr) const
+{
+    char ip[INET_ADDRSTRLEN] = {};
+    if (!inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip))) return "?";
+    return ip;
+}
+
 void Server::handleSystemCallError(std::string errorMsg)
 {
     std::cerr << "Server error on port " << PORT
@@ -43,6 +240,18 @@ int Server::initializeServerSocket()
 
 void Server::closeClientSocket(int index)
 {
+#ifdef FREIA_HAVE_IO_URING
+    // A pending multishot recv keeps the socket open, cancel it first
+    if (ring) retireIoUringConnection(clientSocket[index]);
+#endif
+    tcpTuning.forget(clientSocket[index]);
+    backlogs.erase(clientSocket[index]);
+    inboxes.erase(clientSocket[index]);
+    outboxes.erase(clientSocket[index]);
+    // The fd may be reused before the end of the iteration, the new connection must not be dropped
+    failedSockets.erase(std::remove(failedSockets.begin(), failedSockets.end(), clientSocket[index]), failedSockets.end());
+    fileRelay.setCongested(clientSocket[index], false);
+    memoryBudget.releaseConnection();
     close(clientSocket[index]);
     clientSocket[index] = 0;
 }
@@ -54,19 +263,28 @@ void Server::collectActiveClientSockets()
     {
         currentSocket = clientSocket[i];
 
-        // if valid socket, add to set
-        if (currentSocket > 0)
+        // if valid socket, add to set (senders ahead of their receivers wait for ACKs)
+        if (currentSocket > 0 && !fileRelay.isPaused(currentSocket))
             FD_SET(currentSocket, &readfds);
+        // backlogs and queued frames are sent whenever there is room in the socket buffer
+        if (currentSocket > 0 && (backlogs.count(currentSocket) || outboxes.count(currentSocket)))
+            FD_SET(currentSocket, &writefds);
         // highest file descriptor number, needed for select func
         if (currentSocket > max_socket)
             max_socket = currentSocket;
     }
+    // connections still in their handshake
+    for (const auto& [fd, deadline] : handshakes) {
+        FD_SET(fd, &readfds);
+        max_socket = std::max(max_socket, fd);
+    }
 }
 
 void Server::waitForServerActivity()
 {
-    // wait indeffinitely for socket activity (timeout is NULL)
-    activity = select(max_socket + 1, &readfds, NULL, NULL, NULL);
+    // wait for socket activity until maintenance is due or a lost peer has to be redialed
+    timeval timeout{secondsUntilTimer(), 0};
+    activity = select(max_socket + 1, &readfds, &writefds, NULL, &timeout);
     if ((activity < 0) && (errno != EINTR))
     {
         handleSystemCallError("Select error\n");
@@ -82,191 +300,330 @@ void Server::connectNewClientSocket()
             handleSystemCallError("accept failed");
             return;
         }
+        // The handshake is read by handleClientActivity like any other frame
+        admitClient(newSocket);
+    }
+}
 
-        std::string clientIp = inet_ntoa(address.sin_addr);
-        int clientPort = ntohs(address.sin_port);
-        std::cout << "New incoming connection: " << clientIp << ":" << clientPort << " (fd=" << newSocket << ")\n";        
-        
-        //  HANDSHAKE / AUTHENTICATION
-
-        // 1. Read length prefix
-        uint32_t lenNet = 0;
-        int r = recv(newSocket, &lenNet, sizeof(lenNet), MSG_WAITALL);
-        if (r != sizeof(lenNet)) {
-            std::cout << "Handshake failed: incomplete length prefix from " 
-                    << clientIp << ":" << clientPort << "\n";
-            close(newSocket);
-            return;
-        }
+// A freshly accepted socket is charged to the memory budget right away and has
+// HANDSHAKE_TIMEOUT_SECONDS for its PROT2 handshake, see authenticateClient
+bool Server::admitClient(int newSocket)
+{
+    getpeername(newSocket, (struct sockaddr*)&address, (socklen_t*)&addrlen);
+    std::cout << "New incoming connection: " << ipOf(address) << ":" << ntohs(address.sin_port)
+              << " (fd=" << newSocket << ")\n";
 
-        uint32_t len = ntohl(lenNet);
-        if (len == 0 || len > 65536) {
-            std::cout << "Handshake failed: invalid length " << len 
-                    << " from " << clientIp << ":" << clientPort << "\n";
-            close(newSocket);
-            return;
-        }
+    // The worst case memory of one more connection has to fit the budget
+    if (!memoryBudget.admitConnection()) {
+        std::cout << "Memory budget reached - rejecting fd " << newSocket << "\n";
+        close(newSocket);
+        return false;
+    }
+    setNonBlocking(newSocket);
+    tcpTuning.applyToClient(newSocket);
+    handshakes[newSocket] = time(nullptr) + HANDSHAKE_TIMEOUT_SECONDS;
+    return true;
+}
 
-        // 2. Read ciphertext
-        std::string cipher(len, '\0');
-        r = recv(newSocket, cipher.data(), len, MSG_WAITALL);
-        if (r != static_cast<int>(len)) {
-            std::cout << "Handshake failed: incomplete payload from " 
-                    << clientIp << ":" << clientPort << "\n";
-            close(newSocket);
-            return;
-        }
+void Server::dropHandshake(int sock, const std::string& reason)
+{
+    getpeername(sock, (struct sockaddr*)&address, (socklen_t*)&addrlen);
+    std::cout << "Handshake failed: " << reason << " from " << ipOf(address) << ":"
+              << ntohs(address.sin_port) << "\n";
+#ifdef FREIA_HAVE_IO_URING
+    if (ring) retireIoUringConnection(sock);
+#endif
+    handshakes.erase(sock);
+    inboxes.erase(sock);
+    outboxes.erase(sock);
+    tcpTuning.forget(sock);
+    memoryBudget.releaseConnection();
+    close(sock);
+}
 
-        // 3. Decrypt
-        std::string plain = FreiaEncryption::decryptData(cipher, serverKey);
-        if (plain.empty()) {
-            std::cout << "Handshake failed: decryption failed (wrong password?) from " 
-                    << clientIp << ":" << clientPort << "\n";
-            close(newSocket);
-            return;
-        }
+// Clients that connect and never finish their handshake must not hold on to the budget
+void Server::expireHandshakes()
+{
+    time_t now = time(nullptr);
+    std::vector<int> expired;
+    for (const auto& [fd, deadline] : handshakes) {
+        if (deadline <= now) expired.push_back(fd);
+    }
+    for (int fd : expired) dropHandshake(fd, "timed out");
+}
 
-        // 4. Parse PROT2 handshake
-        auto parts = splitByNewline(plain);
-        if (parts.size() < 2 || parts[0] != "PROT2") {
-            std::cout << "Handshake failed: invalid format from " 
-                    << clientIp << ":" << clientPort << "\n";
-            close(newSocket);
-            return;
-        }
+// Runs the PROT2 handshake frame of an admitted socket, returns the client slot or -1
+int Server::authenticateClient(int newSocket, std::string_view encrypted)
+{
+    getpeername(newSocket, (struct sockaddr*)&address, (socklen_t*)&addrlen);
+    std::string clientIp = ipOf(address);
+    int clientPort = ntohs(address.sin_port);
 
-        std::string username = parts[1];
-        // Validate username (length, chars, sanitize)
-        if (username.empty() || username.size() > 64) {
-            std::cout << "Handshake failed: invalid username length from " 
-                    << clientIp << ":" << clientPort << "\n";
-            close(newSocket);
-            return;
-        }
+    // 1. Decrypt
+    std::string plain = FreiaEncryption::decryptData(std::string(encrypted), serverKey);
+    if (plain.empty()) {
+        dropHandshake(newSocket, "decryption failed (wrong password?)");
+        return -1;
+    }
 
-        // SUCCESS: authenticated & username known
+    // 2. Parse PROT2 handshake
+    auto parts = splitByNewline(plain);
+    if (parts.size() < 2 || parts[0] != "PROT2") {
+        dropHandshake(newSocket, "invalid format");
+        return -1;
+    }
 
-        // Store username immediately
-        {
-            std::lock_guard<std::mutex> lock(socketMutex);
-            socketToUsername[newSocket] = username;
-        }
+    std::string username(parts[1]);
+    // Validate username (length, chars, sanitize)
+    if (username.empty() || username.size() > 64) {
+        dropHandshake(newSocket, "invalid username length");
+        return -1;
+    }
 
-        std::cout << "Authenticated: " << username << " from " 
-                << clientIp << ":" << clientPort << " (fd=" << newSocket << ")\n";
+    // SUCCESS: authenticated & username known
+    bool slotFree;
+    {
+        std::lock_guard<std::mutex> lock(socketMutex);
+        slotFree = std::find(clientSocket.begin(), clientSocket.end(), 0) != clientSocket.end();
+    }
+    if (!slotFree) {
+        dropHandshake(newSocket, "server full, rejecting " + username);
+        return -1;
+    }
 
-        // 5. Send OK reply (encrypted)
-        std::string okPlain = "PROT2\nWelcome " + username + "!";
-        std::string okCipher = FreiaEncryption::encryptData(okPlain, serverKey);
-        if (okCipher.empty()) {
-            std::cerr << "[Critical] Failed to encrypt PROT2 reply\n";
-            close(newSocket);
-            socketToUsername.erase(newSocket);
-            return;
-        }
+    // "PROT2\nusername\nRESUME\nticket" picks up an earlier login without PROT4, a ticket
+    // that is invalid, expired, used or for someone else falls back to the normal welcome.
+    // It is only redeemed once the connection is admitted, a rejected client keeps its ticket,
+    // and so does the owner of a ticket someone else presented.
+    std::optional<SessionTickets::Ticket> resumed;
+    if (parts.size() >= 4 && parts[2] == "RESUME") {
+        resumed = tickets.redeem(parts[3], username);
+        if (!resumed) std::cout << "[Resume] Rejected ticket from " << username << "\n";
+    }
 
-        if (!sendWithLengthPrefix(newSocket, okCipher))
-        {
-            std::cout << "Failed to send OK reply to " << username << "\n";
-            close(newSocket);
-            socketToUsername.erase(newSocket);
-            return;
-        }
+    std::cout << "Authenticated: " << username << " from " 
+            << clientIp << ":" << clientPort << " (fd=" << newSocket << ")"
+            << (resumed ? " - session resumed" : "") << "\n";
 
-        broadcastProt3(username, "userJoined");
-        
-        bool added = false;
-        {
-            std::lock_guard<std::mutex> lock(socketMutex);
-            for (int i = 0; i < maxClients; ++i) {
-                if (clientSocket[i] == 0) {
-                    clientSocket[i] = newSocket;
-                    std::cout << "Added authenticated client " << username 
-                    << " at slot " << i << "\n";
-                    added = true;
-                    break;
-                }
+    // 3. Send OK reply (encrypted), a resumed session gets its next ticket right away.
+    // Its backlog has not started yet, the new ticket resumes from where this one does.
+    std::string okPlain = "PROT2\nWelcome " + username + "!";
+    if (resumed) {
+        std::string ticket = tickets.issue(username, offlineStore.getCursor(username).value_or(resumed->cursor));
+        if (!ticket.empty())
+            okPlain = "PROT2\nRESUMED\n" + ticket + "\n" + std::to_string(SessionTickets::LIFETIME_SECONDS);
+    }
+    std::string okCipher = FreiaEncryption::encryptData(okPlain, serverKey);
+    if (okCipher.empty()) {
+        std::cerr << "[Critical] Failed to encrypt PROT2 reply\n";
+        dropHandshake(newSocket, "no reply");
+        return -1;
+    }
+
+    if (!sendWithLengthPrefix(newSocket, okCipher))
+    {
+        dropHandshake(newSocket, "failed to send OK reply to " + username);
+        return -1;
+    }
+
+    broadcastProt3(username, "userJoined");
+    
+    int slot = -1;
+    {
+        std::lock_guard<std::mutex> lock(socketMutex);
+        for (int i = 0; i < maxClients; ++i) {
+            if (clientSocket[i] == 0) {
+                clientSocket[i] = newSocket;
+                clientUsername[i] = usernames.intern(username);
+                std::cout << "Added authenticated client " << username 
+                << " at slot " << i << "\n";
+                slot = i;
+                break;
             }
-            
-        }
-        if (!added) {
-            std::cout << "Server full - rejecting " << username << "\n";
-            close(newSocket);
-            socketToUsername.erase(newSocket);
         }
-        sendFullUserList(newSocket);
+        
+    }
+    if (slot < 0) {
+        dropHandshake(newSocket, "server full, rejecting " + username);
+        return -1;
     }
+    handshakes.erase(newSocket);
+    federation.userJoined(username);
+    sendFullUserList(newSocket);
+
+    // Catch up on everything sent while this user was away. The cursor saved on disconnect
+    // is the exact position, the ticket's covers a user the store has no cursor for.
+    // The backlog is streamed by the loop as the socket drains, see continueBacklog.
+    if (resumed && !offlineStore.getCursor(username))
+        offlineStore.setCursor(username, resumed->cursor);
+    if (auto delivery = offlineStore.beginBacklog(username)) backlogs[newSocket] = *delivery;
+    return slot;
 }
 
 void Server::handleClientActivity()
 {
-    std::lock_guard<std::mutex> lock(socketMutex);
-    for (int i = 0; i < maxClients; i++)
+    std::pmr::vector<int> readable(&frameArena);
     {
-        currentSocket = clientSocket[i];
-        if (currentSocket == 0 || !FD_ISSET(currentSocket, &readfds))
-            continue;
-
-        uint32_t packetLengthNet = 0;
-        int r = recv(currentSocket, &packetLengthNet, sizeof(packetLengthNet), MSG_WAITALL);
-        if (r <= 0)
-        {
-            getpeername(currentSocket, (struct sockaddr*)&address, (socklen_t*)&addrlen);
-            std::cout << "Host disconnected! ip: " << inet_ntoa(address.sin_addr)
-                      << " port: " << ntohs(address.sin_port) << "\n";
-            disconnectClient(i, "Client Disconnected");
-            continue;
+        std::lock_guard<std::mutex> lock(socketMutex);
+        for (int i = 0; i < maxClients; i++) {
+            if (clientSocket[i] > 0 && FD_ISSET(clientSocket[i], &readfds)) readable.push_back(clientSocket[i]);
         }
+    }
+    for (const auto& [fd, deadline] : handshakes) {
+        if (FD_ISSET(fd, &readfds)) readable.push_back(fd);
+    }
+    for (int fd : readable) readClientInput(fd);
+}
 
-        uint32_t packetLength = ntohl(packetLengthNet);
-        if (packetLength == 0 || packetLength > MAX_PACKET_SIZE)
-        {
-            std::string errWarning = "[Warning] Invalid length: " + packetLength + std::string("\n");
-            disconnectClient(i, errWarning);
-            continue;
-        }
+// One non-blocking read per readiness, whatever it completes is handled right away
+void Server::readClientInput(int fd)
+{
+    int slot = -1;
+    for (int i = 0; i < maxClients; ++i) {
+        if (clientSocket[i] == fd) slot = i;
+    }
+    // dropped by a frame handled before
+    if (slot < 0 && !handshakes.count(fd)) return;
 
-        std::string encrypted(packetLength, '\0');
-        r = recv(currentSocket, encrypted.data(), packetLength, MSG_WAITALL);
-        if (r <= 0)
-        {
-            disconnectClient(i, "[Error] Failed to read payload\n");
-            continue;
-        }
-        // Decrypt with server password key
-        std::string plaintext = FreiaEncryption::decryptData(encrypted, serverKey);
-        if (plaintext.empty())
-        {
-            disconnectClient(i, "[Auth fail] Decryption failed - likely wrong server password\n");
-            continue;
+    PooledBuffer data = framePool.acquire(readBytes);
+    ssize_t r = recv(fd, data.data(), readBytes, MSG_DONTWAIT);
+    if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return;
+    if (r <= 0)
+    {
+        if (slot < 0) {
+            dropHandshake(fd, "connection closed");
+            return;
         }
+        getpeername(fd, (struct sockaddr*)&address, (socklen_t*)&addrlen);
+        std::cout << "Host disconnected! ip: " << ipOf(address)
+                  << " port: " << ntohs(address.sin_port) << "\n";
+        disconnectClient(slot, "Client Disconnected");
+        return;
+    }
+    // Built at its exact size, appending could leave it twice as big as what is charged for it
+    std::string& inbox = inboxes[fd];
+    std::string joined;
+    joined.reserve(inbox.size() + static_cast<size_t>(r));
+    joined.append(inbox).append(data.data(), static_cast<size_t>(r));
+    inbox.swap(joined);
+    drainInbox(fd);
+}
 
-        auto parts = splitByNewline(plaintext);
-        std::string protocol = parts[0];
-        if(protocol == "PROT1")
-        {
-            processProt1(i, encrypted, plaintext);
-        }
-        else if (protocol == "PROT4") {
-            processProt4(i, plaintext);
+// The inbox is taken out of the map while its frames are handled, a handler may drop the client
+void Server::drainInbox(int fd)
+{
+    auto it = inboxes.find(fd);
+    if (it == inboxes.end()) return;
+    std::string input = std::move(it->second);
+    inboxes.erase(it);
+
+    auto used = processInput(fd, input);
+    if (used && *used < input.size()) inboxes[fd] = *used > 0 ? input.substr(*used) : std::move(input);
+}
+
+// Runs the complete frames at the start of input through the same handlers for both loops,
+// on a new connection the first one is its handshake. Stops at a sender that got paused and
+// returns how many bytes were used, nothing when the connection was dropped.
+std::optional<size_t> Server::processInput(int fd, std::string_view input)
+{
+    int slot = -1;
+    for (int i = 0; i < maxClients; ++i) {
+        if (clientSocket[i] == fd) slot = i;
+    }
+
+    size_t pos = 0;
+    if (slot < 0)
+    {
+        if (!handshakes.count(fd)) return std::nullopt;
+        if (input.size() < sizeof(uint32_t)) return 0;
+        uint32_t lengthNet = 0;
+        std::memcpy(&lengthNet, input.data(), sizeof(lengthNet));
+        uint32_t length = ntohl(lengthNet);
+        if (length == 0 || length > maxHandshakeBytes) {
+            dropHandshake(fd, "invalid length " + std::to_string(length));
+            return std::nullopt;
         }
-        else
+        if (input.size() - sizeof(lengthNet) < length) return 0;
+
+        pos = sizeof(lengthNet) + length;
+        slot = authenticateClient(fd, input.substr(sizeof(lengthNet), length));
+        if (slot < 0) return std::nullopt;
+    }
+
+    while (input.size() - pos >= sizeof(uint32_t) && !fileRelay.isPaused(fd))
+    {
+        uint32_t lengthNet = 0;
+        std::memcpy(&lengthNet, input.data() + pos, sizeof(lengthNet));
+        uint32_t length = ntohl(lengthNet);
+        bool fileChunk = length & FileRelay::CHUNK_FLAG;
+        length &= ~FileRelay::CHUNK_FLAG;
+
+        bool valid = fileChunk
+            ? length >= FileRelay::CHUNK_HEADER_SIZE && length <= FileRelay::CHUNK_HEADER_SIZE + maxChunkBytes
+            : length > 0 && length <= MAX_PACKET_SIZE;
+        if (!valid)
         {
-            handleSystemCallError("[Protocol error] Malformed or missing Protocol1\n");
+            disconnectClient(slot, "[Warning] Invalid length: " + std::to_string(length) + "\n");
+            return std::nullopt;
         }
+        if (input.size() - pos - sizeof(lengthNet) < length) break;
+
+        std::string_view frame = input.substr(pos + sizeof(lengthNet), length);
+        pos += sizeof(lengthNet) + length;
+        if (fileChunk) relayFileChunk(slot, frame);
+        else processFrame(slot, frame);
+
+        if (clientSocket[slot] != fd) return std::nullopt;
+    }
+    return pos;
+}
+
+// Decrypts one complete frame and hands it to its protocol handler
+void Server::processFrame(int clientIndex, std::string_view encrypted)
+{
+    // Decrypt with server password key
+    PooledBuffer plaintextBuffer = framePool.acquire(encrypted.size());
+    size_t plaintextLength = FreiaEncryption::decryptInto(encrypted, serverKey,
+                                                          plaintextBuffer.data(), plaintextBuffer.capacity());
+    if (plaintextLength == 0)
+    {
+        disconnectClient(clientIndex, "[Auth fail] Decryption failed - likely wrong server password\n");
+        return;
+    }
+    std::string_view plaintext(plaintextBuffer.data(), plaintextLength);
+
+    auto parts = splitByNewline(plaintext);
+    std::string_view protocol = parts.empty() ? std::string_view() : parts[0];
+    if(protocol == "PROT1")
+    {
+        processProt1(clientIndex, encrypted, plaintext);
+    }
+    else if (protocol == "PROT4") {
+        processProt4(clientIndex, plaintext);
+    }
+    else if (protocol == "PROT5") {
+        processProt5(clientIndex, plaintext);
+    }
+    else
+    {
+        handleSystemCallError("[Protocol error] Malformed or missing Protocol1\n");
     }
 }
 
-void Server::processProt1(int clientIndex, const std::string& encrypted, const std::string& plaintext)
+void Server::processProt1(int clientIndex, std::string_view encrypted, std::string_view plaintext)
 {
     int currentSocket = clientSocket[clientIndex];
 
     auto parts = splitByNewline(plaintext);
+    if (parts.size() < 3) {
+        disconnectClient(clientIndex, "[Protocol error] Malformed PROT1\n");
+        return;
+    }
 
-    std::string username = parts[1];
+    std::string_view username = parts[1];
     size_t innerLen = 0;
     try {
-        innerLen = std::stoul(parts[2]);
+        innerLen = std::stoul(std::string(parts[2]));
     } catch (...) {
         disconnectClient(clientIndex, "[Protocol error] Invalid length field\n");
         return;
@@ -280,43 +637,62 @@ void Server::processProt1(int clientIndex, const std::string& encrypted, const s
         return;
     }
 
-    std::string innerCipher = plaintext.substr(plaintext.size() - innerLen);
+    std::string_view innerCipher = plaintext.substr(plaintext.size() - innerLen);
 
     std::cout << "[PROT1] From user '" << username << "' - inner ciphertext size: "
-              << innerLen << " bytes\n";
+              << innerCipher.size() << " bytes\n";
 
+    std::pmr::vector<int> targets(&frameArena);
     for (int j = 0; j < maxClients; ++j)
     {
         int socketTarget = clientSocket[j];
-        if (socketTarget != 0 && socketTarget != currentSocket)
+        // clients still catching up get this frame from the store, after everything older
+        if (socketTarget != 0 && socketTarget != currentSocket && !backlogs.count(socketTarget))
+            targets.push_back(socketTarget);
+    }
+
+    auto failed = fanOut(targets.data(), targets.size(), encrypted);
+    for (int socketTarget : targets)
+    {
+        if (std::find(failed.begin(), failed.end(), socketTarget) != failed.end())
         {
-            if(!sendWithLengthPrefix(socketTarget, encrypted))
-            {
-                std::string errWarning = "[Warning] Failed to forward to socket " + socketTarget + std::string("\n");
-                handleSystemCallError(errWarning);
-            }
-            else
-            {
-                std::cout << "[Forwarded] " << encrypted.size() << " bytes to socket " << socketTarget << "\n";
-            }
+            std::string errWarning = "[Warning] Failed to forward to socket " + socketTarget + std::string("\n");
+            handleSystemCallError(errWarning);
+        }
+        else
+        {
+            std::cout << "[Forwarded] " << encrypted.size() << " bytes to socket " << socketTarget << "\n";
         }
     }
+
+    // Keep a copy for users that are offline right now
+    offlineStore.append(encrypted);
+
+    // Users on other nodes get the same frame, it goes out with this iteration's batch
+    federation.publishChat(encrypted);
 }
 
 void Server::broadcastProt3(const std::string& messageText, const std::string& messageType, int onlyTo)
 {        // if (send(newSocket, &okLenNet, sizeof(okLenNet), 0) != sizeof(okLenNet) ||
 
-    std::string frame = "PROT3\n" + messageType + "\n" + messageText;
-    std::string encrypted = FreiaEncryption::encryptData(frame, serverKey);
-    if (encrypted.empty()) return;
+    std::pmr::string frame(&frameArena);
+    frame.reserve(6 + messageType.size() + 1 + messageText.size());
+    frame.append("PROT3\n").append(messageType).append("\n").append(messageText);
+
+    PooledBuffer encryptedBuffer = framePool.acquire(frame.size() + 32);
+    size_t encryptedLength = FreiaEncryption::encryptInto(frame, serverKey,
+                                                          encryptedBuffer.data(), encryptedBuffer.capacity());
+    if (encryptedLength == 0) return;
+    std::string_view encrypted(encryptedBuffer.data(), encryptedLength);
     
     if (onlyTo == -1)
     {
+        std::pmr::vector<int> targets(&frameArena);
         for (int j = 0; j < maxClients; ++j) {
             int target = clientSocket[j];
-            if (onlyTo != -1 && target != onlyTo) continue;
-            sendWithLengthPrefix(target, encrypted);            
+            if (target > 0) targets.push_back(target);
         }
+        fanOut(targets.data(), targets.size(), encrypted);
     }
     else
     {
@@ -333,7 +709,7 @@ void Server::broadcastProt3(const std::string& messageText, const std::string& m
         
 }
 
-void Server::processProt4(int clientIndex, const std::string& plaintext)
+void Server::processProt4(int clientIndex, std::string_view plaintext)
 {
     int sock = clientSocket[clientIndex];
 
@@ -343,9 +719,9 @@ void Server::processProt4(int clientIndex, const std::string& plaintext)
         return;
     }
 
-    std::string cmd = parts[1];
-    std::string username = parts[2];
-    std::string receivedKeyB64 = (parts.size() > 3) ? parts[3] : "";
+    std::string_view cmd = parts[1];
+    std::string username(parts[2]);
+    std::string receivedKeyB64 = (parts.size() > 3) ? std::string(parts[3]) : "";
 
     // Basic validation
     if (username.empty() || username.size() > 64 || receivedKeyB64.empty()) {
@@ -368,6 +744,16 @@ void Server::processProt4(int clientIndex, const std::string& plaintext)
         {
             std::cout << "[Login success] " << username << "\n";
             sendSuccess(sock, "Login successful");
+
+            // Lets the client resume with PROT2 RESUME instead of logging in again. The ticket
+            // holds how far this connection got, or the saved cursor for an account logged into
+            // under another PROT2 name.
+            uint64_t cursor = username == usernameOf(clientIndex)
+                                  ? deliveryCursor(sock)
+                                  : offlineStore.getCursor(username).value_or(offlineStore.endOffset());
+            std::string ticket = tickets.issue(username, cursor);
+            if (!ticket.empty())
+                sendEncrypted(sock, "PROT4\nTICKET\n" + ticket + "\n" + std::to_string(SessionTickets::LIFETIME_SECONDS));
         } else {
             sendError(sock, "Username not found or incorrect key");
         }
@@ -377,12 +763,134 @@ void Server::processProt4(int clientIndex, const std::string& plaintext)
     }
 }
 
+void Server::processProt5(int clientIndex, std::string_view plaintext)
+{
+    int sock = clientSocket[clientIndex];
+
+    auto parts = splitByNewline(plaintext);
+    if (parts.size() < 3) {
+        sendProt5(sock, "PROT5\nFAIL\n0\nMalformed PROT5");
+        return;
+    }
+
+    std::string cmd(parts[1]);
+    uint32_t streamId = 0;
+    uint64_t value = 0;
+    try {
+        streamId = static_cast<uint32_t>(std::stoul(std::string(parts[2])));
+        if (parts.size() > 3) value = std::stoull(std::string(parts[3]));
+    } catch (...) {
+        sendProt5(sock, "PROT5\nFAIL\n" + std::string(parts[2]) + "\nInvalid number");
+        return;
+    }
+    std::string id = std::to_string(streamId);
+    std::string username(usernameOf(clientIndex));
+
+    if (cmd == "OFFER")
+    {
+        // OFFER <id> <size> <client encrypted metadata>
+        auto secret = fileRelay.offer(streamId, sock, username, value);
+        if (!secret) {
+            sendProt5(sock, "PROT5\nFAIL\n" + id + "\nStream id in use or too many open streams");
+            return;
+        }
+        // Only the sender learns the secret, it is needed to RESUME after a disconnect
+        sendProt5(sock, "PROT5\nOFFERED\n" + id + "\n" + std::to_string(*secret));
+        std::string meta = (parts.size() > 4) ? std::string(parts[4]) : "";
+        std::string frame = "PROT5\nOFFER\n" + id + "\n" + username + "\n" + std::to_string(value) + "\n" + meta;
+        std::string encrypted = FreiaEncryption::encryptData(frame, serverKey);
+        if (encrypted.empty()) return;
+        std::pmr::vector<int> targets(&frameArena);
+        for (int j = 0; j < maxClients; ++j) {
+            if (clientSocket[j] != 0 && clientSocket[j] != sock)
+                targets.push_back(clientSocket[j]);
+        }
+        fanOut(targets.data(), targets.size(), encrypted);
+        std::cout << "[PROT5] " << username << " offers stream " << id << " (" << value << " bytes)\n";
+    }
+    else if (cmd == "ACCEPT")
+    {
+        // ACCEPT <id> <offset the receiver already has>
+        auto resumeAt = fileRelay.accept(streamId, sock, value);
+        const FileRelay::Stream* stream = fileRelay.find(streamId);
+        if (!resumeAt || !stream) {
+            sendProt5(sock, "PROT5\nFAIL\n" + id + "\nUnknown stream");
+            return;
+        }
+        if (stream->senderSocket > 0)
+            sendProt5(stream->senderSocket, "PROT5\nRESUME\n" + id + "\n" + std::to_string(*resumeAt));
+    }
+    else if (cmd == "RESUME")
+    {
+        // Sender came back after a disconnect: RESUME <id> <secret from OFFERED>
+        auto resumeAt = fileRelay.resume(streamId, sock, username, value);
+        if (!resumeAt) {
+            sendProt5(sock, "PROT5\nFAIL\n" + id + "\nUnknown stream");
+            return;
+        }
+        sendProt5(sock, "PROT5\nRESUME\n" + id + "\n" + std::to_string(*resumeAt));
+    }
+    else if (cmd == "ACK")
+    {
+        fileRelay.ack(streamId, sock, value);
+    }
+    else if (cmd == "END" || cmd == "CANCEL")
+    {
+        auto stream = fileRelay.close(streamId, sock);
+        if (!stream) {
+            // Receivers can only leave, not end the transfer for everyone
+            fileRelay.removeReceiver(streamId, sock);
+            return;
+        }
+        for (const auto& [receiverSocket, receiver] : stream->receivers) {
+            sendProt5(receiverSocket, "PROT5\n" + cmd + "\n" + id);
+        }
+        std::cout << "[PROT5] Stream " << id << " from " << username << " closed (" << cmd << ")\n";
+    }
+    else {
+        sendProt5(sock, "PROT5\nFAIL\n" + id + "\nUnknown PROT5 command");
+    }
+}
+
+void Server::sendProt5(int sock, const std::string& frame)
+{
+    sendEncrypted(sock, frame);
+}
+
+// Relays one complete chunk (header + payload) without blocking. What a receiver's socket has
+// no room for waits in its outbox, the sender is paused until it went out.
+void Server::relayFileChunk(int clientIndex, std::string_view chunk)
+{
+    int sock = clientSocket[clientIndex];
+    uint32_t streamIdNet = 0;
+    std::memcpy(&streamIdNet, chunk.data(), sizeof(streamIdNet));
+    uint64_t offset = 0;
+    for (int b = 4; b < 12; ++b) offset = (offset << 8) | static_cast<unsigned char>(chunk[b]);
+
+    uint32_t payloadLength = static_cast<uint32_t>(chunk.size()) - FileRelay::CHUNK_HEADER_SIZE;
+    std::vector<int> targets = fileRelay.targetsFor(ntohl(streamIdNet), sock, offset, payloadLength);
+    std::vector<int> failed;
+    for (int target : targets) {
+        if (!sendWithLengthPrefix(target, chunk, FileRelay::CHUNK_FLAG)) failed.push_back(target);
+    }
+
+    // Broken receivers are dropped from the stream, their socket cleanup happens as usual
+    for (int target : failed) fileRelay.removeReceiver(ntohl(streamIdNet), target);
+}
+
 // Send full user list to one specific client
 void Server::sendFullUserList(int targetSocket)
 {
     std::string list;
     {
-        for (const auto& [fd, name] : socketToUsername) {
+        for (int i = 0; i < maxClients; ++i) {
+            if (clientUsername[i] == UsernameTable::NONE) continue;
+            if (!list.empty()) list += "\n";
+            list += usernames.name(clientUsername[i]);
+        }
+        // Users connected to other nodes, the interning table knows every local name
+        for (const auto& [name, links] : federation.remoteUsers()) {
+            if (usernames.contains(name)) continue;
             if (!list.empty()) list += "\n";
             list += name;
         }
@@ -392,33 +900,421 @@ void Server::sendFullUserList(int targetSocket)
     broadcastProt3(list, "userList", targetSocket);
 }
 
+void Server::logMemoryStats()
+{
+    const BufferPool::Stats& pool = framePool.stats();
+    double hitRate = pool.acquires ? 100.0 * pool.hits / pool.acquires : 0.0;
+    std::cout << "[Memory] Frame pool hit rate " << hitRate << "% (" << pool.hits << "/" << pool.acquires
+              << "), peak in use " << pool.peakInUseBytes << " bytes, cached " << pool.cachedBytes
+              << " bytes; arena peak " << frameArena.peakBytes() << " bytes, overflows "
+              << frameArena.overflowCount() << "\n";
+
+    // RSS growth since setup over the connections gives the real cost of one
+    size_t rss = residentBytes();
+    size_t connections = memoryBudget.connections();
+    std::cout << "[Memory] " << connections << " connections, accounted " << memoryBudget.usedBytes()
+              << " bytes (" << memoryBudget.bytesPerConnection() << " per connection), RSS " << rss << " bytes";
+    if (connections > 0 && rss > baselineRssBytes)
+        std::cout << ", " << (rss - baselineRssBytes) / connections << " bytes per connection since startup";
+    std::cout << "\n";
+
+    const TcpTuning::Stats& tcp = tcpTuning.stats();
+    std::cout << "[TCP] " << (tcpTuning.currentPolicy().mode == TcpTuning::Mode::Latency ? "latency" : "throughput")
+              << " mode, corked bursts " << tcp.corkedBursts << ", coalesced frames " << tcp.coalescedFrames << "\n";
+}
+
+// Sends this iteration's batches to the other nodes, applies what they sent and redials lost peers
+void Server::pumpFederation()
+{
+    if (!federation.enabled()) return;
+    federation.flush();
+    federationRetry = federation.maintain();
+    handleFederationEvents();
+}
+
+void Server::handleFederationEvents()
+{
+    for (const auto& event : federation.takeEvents())
+    {
+        if (event.type == Federation::Event::UserJoined) {
+            broadcastProt3(event.username, "userJoined");
+        }
+        else if (event.type == Federation::Event::UserLeft) {
+            broadcastProt3(event.username + " disconnected.", "userDisconnected");
+            broadcastProt3(event.username, "userLeft");
+        }
+        else {
+            // PROT1 from a user on another node, same handling as a local one minus the checks
+            std::pmr::vector<int> targets(&frameArena);
+            for (int j = 0; j < maxClients; ++j) {
+                if (clientSocket[j] > 0 && !backlogs.count(clientSocket[j])) targets.push_back(clientSocket[j]);
+            }
+            fanOut(targets.data(), targets.size(), event.frame);
+            offlineStore.append(event.frame);
+        }
+    }
+}
+
+// Streams the next slice of a backlog, called when the socket is writable
+uint64_t Server::deliveryCursor(int sock) const
+{
+    auto backlog = backlogs.find(sock);
+    return backlog != backlogs.end() ? backlog->second.resumeOffset() : offlineStore.endOffset();
+}
+
+void Server::continueBacklog(int sock, size_t maxBytes)
+{
+    auto it = backlogs.find(sock);
+    if (it == backlogs.end()) return;
+
+    MessageStore::Progress progress = offlineStore.continueBacklog(sock, it->second, maxBytes);
+    if (progress == MessageStore::Progress::More) return;
+    if (progress == MessageStore::Progress::Done) {
+        backlogs.erase(it);
+        return;
+    }
+    for (int i = 0; i < maxClients; ++i) {
+        if (clientSocket[i] == sock) disconnectClient(i, "[Error] Failed to deliver backlog\n");
+    }
+    backlogs.erase(sock);
+}
+
+// A new frame for the socket has to wait behind queued ones and a half sent backlog record
+bool Server::hasPendingOutput(int sock) const
+{
+    if (outboxes.count(sock)) return true;
+#ifdef FREIA_HAVE_IO_URING
+    auto connection = ringConnections.find(sock);
+    if (connection != ringConnections.end() && connection->second.sendInFlight) return true;
+#endif
+    auto backlog = backlogs.find(sock);
+    return backlog != backlogs.end() && backlog->second.midRecord();
+}
+
+// Appends a frame (head + data) to the socket's outbox, or puts it in front when it is the
+// rest of a send that already started. A client that would make it hold more than
+// outboxLimitBytes is not reading and gets dropped.
+void Server::queueOutput(int sock, std::string_view head, std::string_view data, bool first)
+{
+    Outbox& outbox = outboxes[sock];
+    if (outbox.failed) return;
+
+    // Small frames are packed into the last buffer, one pooled buffer each would hold several times their size
+    size_t length = head.size() + data.size();
+    if (!first && !outbox.frames.empty()) {
+        PendingFrame& last = outbox.frames.back();
+        if (last.data.capacity() - last.length >= length) {
+            if (!head.empty()) std::memcpy(last.data.data() + last.length, head.data(), head.size());
+            if (!data.empty()) std::memcpy(last.data.data() + last.length + head.size(), data.data(), data.size());
+            last.length += length;
+            outbox.bytes += length;
+            return;
+        }
+    }
+    size_t capacity = std::max(length, OUTBOX_BUFFER_BYTES);
+    size_t held = BufferPool::capacityFor(capacity) + sizeof(PendingFrame);
+    if (outbox.heldBytes + held > outboxLimitBytes) {
+        std::cout << "[Warning] Output limit exceeded on socket " << sock << ", dropping it\n";
+        outbox.failed = true;
+        outbox.frames.clear();
+        outbox.bytes = 0;
+        outbox.heldBytes = 0;
+        failedSockets.push_back(sock);
+        return;
+    }
+
+    PendingFrame frame;
+    frame.data = framePool.acquire(capacity);
+    if (!head.empty()) std::memcpy(frame.data.data(), head.data(), head.size());
+    if (!data.empty()) std::memcpy(frame.data.data() + head.size(), data.data(), data.size());
+    frame.length = length;
+    outbox.bytes += length;
+    outbox.heldBytes += held;
+    if (first) outbox.frames.push_front(std::move(frame));
+    else outbox.frames.push_back(std::move(frame));
+    fileRelay.setCongested(sock, true);
+}
+
+// Sends queued frames without blocking, true once the outbox is empty
+bool Server::flushOutbox(int sock)
+{
+    auto it = outboxes.find(sock);
+    if (it == outboxes.end()) return true;
+
+    Outbox& outbox = it->second;
+    while (!outbox.failed && !outbox.frames.empty()) {
+        PendingFrame& frame = outbox.frames.front();
+        ssize_t sent = send(sock, frame.data.data() + frame.sent, frame.length - frame.sent,
+                            MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return false;
+        if (sent <= 0) {
+            outbox.failed = true;
+            outbox.frames.clear();
+            outbox.bytes = 0;
+            outbox.heldBytes = 0;
+            failedSockets.push_back(sock);
+            break;
+        }
+        frame.sent += static_cast<size_t>(sent);
+        outbox.bytes -= static_cast<size_t>(sent);
+        if (frame.sent == frame.length) {
+            outbox.heldBytes -= frame.data.capacity() + sizeof(PendingFrame);
+            outbox.frames.pop_front();
+        }
+    }
+    if (outbox.failed) return false;
+
+    outboxes.erase(it);
+    fileRelay.setCongested(sock, false);
+    return true;
+}
+
+// The socket has room again: the rest of a half sent backlog record goes first,
+// then the queued frames, then the next backlog slice
+void Server::handleWritable(int sock)
+{
+#ifdef FREIA_HAVE_IO_URING
+    // What a ring send did not get out is queued in front once it completes
+    auto connection = ringConnections.find(sock);
+    if (connection != ringConnections.end() && connection->second.sendInFlight) return;
+#endif
+    auto backlog = backlogs.find(sock);
+    if (backlog != backlogs.end() && backlog->second.midRecord() && outboxes.count(sock)) {
+        continueBacklog(sock, backlog->second.recordEnd - backlog->second.offset);
+        backlog = backlogs.find(sock);
+        if (backlog != backlogs.end() && backlog->second.midRecord()) return;
+    }
+    if (!flushOutbox(sock)) return;
+    continueBacklog(sock, BACKLOG_SLICE_BYTES);
+}
+
+// Sockets that failed while frames were queued for them, dropped outside of any fan-out
+void Server::dropFailedSockets()
+{
+    std::vector<int> failed;
+    failed.swap(failedSockets);
+    for (int fd : failed) {
+        for (int i = 0; i < maxClients; ++i) {
+            if (clientSocket[i] == fd) disconnectClient(i, "[Error] Failed to send queued frames\n");
+        }
+    }
+}
+
+int Server::secondsUntilTimer() const
+{
+    time_t untilMaintenance = std::max<time_t>(0, nextMaintenance - time(nullptr));
+    int seconds = static_cast<int>(std::min<time_t>(untilMaintenance, MAINTENANCE_SECONDS));
+    for (const auto& [fd, deadline] : handshakes)
+        seconds = std::min(seconds, static_cast<int>(std::max<time_t>(0, deadline - time(nullptr))));
+    return federationRetry >= 0 ? std::min(seconds, federationRetry) : seconds;
+}
+
+// Runs every MAINTENANCE_SECONDS even when nothing is sent, old segments have to age out
+void Server::runMaintenance()
+{
+    offlineStore.compact();
+    // Streams whose sender and receivers all went away are only seen here
+    fileRelay.expireIdle();
+    nextMaintenance = time(nullptr) + MAINTENANCE_SECONDS;
+}
+
 void Server::run()
 {
+    restoreHandoffInput();
+
+#ifdef FREIA_HAVE_IO_URING
+    if (useIoUring && runIoUring()) return;
+#else
+    if (useIoUring) std::cout << "io_uring support not compiled in, using select\n";
+#endif
+    runSelect();
+}
+
+void Server::runSelect()
+{
+    uint64_t iterations = 0;
     while (true)
     {
-        // clear socket set
+        // transient parsing data of the previous iteration is gone
+        frameArena.reset();
+        if (++iterations % STATS_INTERVAL == 0) logMemoryStats();
+
+        // clear socket sets
         FD_ZERO(&readfds);
+        FD_ZERO(&writefds);
 
         // add mastersocket to socket set
         FD_SET(masterSocket, &readfds);
         max_socket = masterSocket;
         
+        if (upgradeSocket >= 0) {
+            FD_SET(upgradeSocket, &readfds);
+            max_socket = std::max(max_socket, upgradeSocket);
+        }
+
+        auto federationSockets = federation.watchedSockets();
+        for (const auto& socket : federationSockets) {
+            FD_SET(socket.fd, &readfds);
+            if (socket.wantsWrite) FD_SET(socket.fd, &writefds);
+            max_socket = std::max(max_socket, socket.fd);
+        }
+
+        // Frames a paused sender left in its inbox go on once it may send again
+        std::pmr::vector<int> resumed(&frameArena);
+        for (const auto& [fd, input] : inboxes) {
+            if (!fileRelay.isPaused(fd)) resumed.push_back(fd);
+        }
+        for (int fd : resumed) drainInbox(fd);
+
         collectActiveClientSockets();
         waitForServerActivity();
+        if (upgradeSocket >= 0 && FD_ISSET(upgradeSocket, &readfds)) {
+            handOff();
+            if (handedOff) return;
+        }
+        for (const auto& socket : federationSockets) {
+            bool readable = FD_ISSET(socket.fd, &readfds);
+            bool writable = socket.wantsWrite && FD_ISSET(socket.fd, &writefds);
+            if (readable || writable) federation.handleReady(socket.fd, socket.id, readable, writable);
+        }
         connectNewClientSocket();
         handleClientActivity();
+
+        std::pmr::vector<int> writable(&frameArena);
+        for (const auto& [fd, delivery] : backlogs) {
+            if (FD_ISSET(fd, &writefds)) writable.push_back(fd);
+        }
+        for (const auto& [fd, outbox] : outboxes) {
+            if (FD_ISSET(fd, &writefds) && !backlogs.count(fd)) writable.push_back(fd);
+        }
+        for (int fd : writable) handleWritable(fd);
+        dropFailedSockets();
+        expireHandshakes();
+
+        pumpFederation();
+        if (time(nullptr) >= nextMaintenance) runMaintenance();
+        tcpTuning.flush();
     }
 }
 
-std::vector<std::string> Server::splitByNewline(const std::string& s)
+// Passes the listening socket and all clients to a new server process and stops serving
+void Server::handOff()
+{
+    int conn = HotRestart::acceptUpgrade(upgradeSocket);
+    if (conn < 0) return;
+
+    std::cout << "[Upgrade] New server process connected, handing off\n";
+#ifdef FREIA_HAVE_IO_URING
+    // Nothing may be read from the clients once their state is captured
+    if (ring) quiesceIoUring();
+#endif
+
+    tcpTuning.flush();
+    HotRestart::State state;
+    state.port = PORT;
+    state.maxClients = maxClients;
+    state.serverKey = serverKey;
+    state.ticketKeys.assign(reinterpret_cast<const char*>(tickets.keys().data()), tickets.keys().size());
+    state.redeemedTickets = tickets.exportRedeemed();
+    state.listenFd = masterSocket;
+    std::vector<std::pair<std::string, uint64_t>> cursors;
+    for (int i = 0; i < maxClients; ++i) {
+        int fd = clientSocket[i];
+        if (fd <= 0) continue;
+
+        HotRestart::ClientState client;
+        client.fd = fd;
+        client.slot = i;
+        client.username = usernameOf(i);
+        client.pendingInput = pendingInputOf(fd);
+
+        // Clients still catching up go on from their cursor in the new process, everyone else
+        // got everything live. What the client is still owed is sent first over there: the rest
+        // of a half sent backlog record, then the queued frames.
+        uint64_t cursor = offlineStore.endOffset();
+        auto backlog = backlogs.find(fd);
+        if (backlog != backlogs.end()) {
+            cursor = backlog->second.resumeOffset();
+            auto rest = offlineStore.recordRest(backlog->second);
+            if (backlog->second.midRecord() && rest) {
+                client.pendingOutput = std::move(*rest);
+                cursor = backlog->second.recordEnd;
+            }
+        }
+        auto outbox = outboxes.find(fd);
+        if (outbox != outboxes.end()) {
+            for (const auto& frame : outbox->second.frames)
+                client.pendingOutput.append(frame.data.data() + frame.sent, frame.length - frame.sent);
+        }
+        if (clientUsername[i] != UsernameTable::NONE) cursors.emplace_back(client.username, cursor);
+        state.clients.push_back(std::move(client));
+    }
+    // Connections still in their handshake go over without a slot and start it over there
+    for (const auto& [fd, deadline] : handshakes) {
+        HotRestart::ClientState client;
+        client.fd = fd;
+        client.pendingInput = pendingInputOf(fd);
+        state.clients.push_back(std::move(client));
+    }
+
+    if (!HotRestart::sendState(conn, state)) {
+        std::cerr << "[Upgrade] Hand-off failed, continuing to serve\n";
+        close(conn);
+#ifdef FREIA_HAVE_IO_URING
+        // Only accept has to be armed again, the loop restarts the recvs that quiesceIoUring stopped
+        if (ring) armIoUringAccept();
+#endif
+        return;
+    }
+
+    for (const auto& [username, cursor] : cursors) offlineStore.setCursor(username, cursor);
+
+    // The new process opens the store only after DONE, so it sees every record and cursor.
+    // Peer links are not handed over, the federation port is freed and the peers redial.
+    offlineStore.flushAndClose();
+    federation.shutdown();
+    HotRestart::sendDone(conn);
+    close(conn);
+
+    // Our copies of the sockets are closed on exit, the new process keeps them open
+    std::cout << "[Upgrade] Handed off " << state.clients.size() << " clients, exiting\n";
+    handedOff = true;
+}
+
+// Frames the previous process had partly read, complete ones are handled right away and
+// the rest is read on by the loop like any other input. Same for handshakes it had not finished.
+void Server::restoreHandoffInput()
+{
+    std::vector<int> fds;
+    for (const auto& [fd, input] : inboxes) fds.push_back(fd);
+    for (int fd : fds) drainInbox(fd);
+}
+
+// Bytes read from a client that are not a complete frame yet, for the hand-off
+std::string Server::pendingInputOf(int fd) const
+{
+#ifdef FREIA_HAVE_IO_URING
+    auto connection = ringConnections.find(fd);
+    if (connection != ringConnections.end()) return connection->second.inbox;
+#endif
+    auto inbox = inboxes.find(fd);
+    return inbox != inboxes.end() ? inbox->second : std::string();
+}
+
+// Lines are views into s, only the vector itself lives in the frame arena
+std::pmr::vector<std::string_view> Server::splitByNewline(std::string_view s)
 {
-    std::vector<std::string> lines;
-    std::string line;
-    std::istringstream iss(s);
-    while (std::getline(iss, line)) {
+    std::pmr::vector<std::string_view> lines(&frameArena);
+    size_t start = 0;
+    while (start < s.size()) {
+        size_t end = s.find('\n', start);
+        if (end == std::string_view::npos) end = s.size();
+        std::string_view line = s.substr(start, end - start);
         if (!line.empty() || !lines.empty()) {
-            lines.push_back(std::move(line));
+            lines.push_back(line);
         }
+        start = end + 1;
     }
     return lines;
 }
@@ -427,13 +1323,17 @@ void Server::disconnectClient(int index, const std::string& reason)
 {
     int victimFd = clientSocket[index];
 
-    std::string username = "Unknown";
-    {
-        auto it = socketToUsername.find(victimFd);
-        if (it != socketToUsername.end()) {
-            username = it->second;
-            socketToUsername.erase(it);
-        }
+    std::string username(usernameOf(index));
+    usernames.release(clientUsername[index]);
+    clientUsername[index] = UsernameTable::NONE;
+
+    fileRelay.dropSocket(victimFd);
+
+    // Everything up to here was delivered live, the backlog starts after it.
+    // A client that had not caught up yet continues where its backlog stopped.
+    if (username != "Unknown") {
+        offlineStore.setCursor(username, deliveryCursor(victimFd));
+        federation.userLeft(username);
     }
 
     std::string message = username + " disconnected.";
@@ -448,7 +1348,7 @@ void Server::disconnectClient(int index, const std::string& reason)
     // Log last
     getpeername(victimFd, (struct sockaddr*)&address, (socklen_t*)&addrlen);
     std::cerr << "Client disconnected (" << reason << "): "
-              << inet_ntoa(address.sin_addr) << ":" << ntohs(address.sin_port)
+              << ipOf(address) << ":" << ntohs(address.sin_port)
               << " (" << username << ")\n";
 }
 
@@ -457,27 +1357,62 @@ void Server::sendSuccess(int sock, const std::string& msg = "")
     std::string frame = "PROT4\nSUCCESS";
     if (!msg.empty()) frame += "\n" + msg;
 
-    std::string enc = FreiaEncryption::encryptData(frame, serverKey);
-    if (enc.empty()) return;
-
-    sendWithLengthPrefix(sock, enc);
+    sendEncrypted(sock, frame);
 }
 
 void Server::sendError(int sock, const std::string& reason)
 {
     std::string frame = "PROT4\nFAIL\n" + reason;
 
-    std::string enc = FreiaEncryption::encryptData(frame, serverKey);
-    if (enc.empty()) return;
+    sendEncrypted(sock, frame);
+}
 
-    sendWithLengthPrefix(sock, enc);
+bool Server::sendEncrypted(int sock, std::string_view frame)
+{
+    PooledBuffer encrypted = framePool.acquire(frame.size() + 32);
+    size_t length = FreiaEncryption::encryptInto(frame, serverKey, encrypted.data(), encrypted.capacity());
+    if (length == 0) return false;
+
+    return sendWithLengthPrefix(sock, std::string_view(encrypted.data(), length));
+}
+
+// Sends one frame to several sockets and returns the ones that failed
+std::pmr::vector<int> Server::fanOut(const int* targets, size_t count, std::string_view data, uint32_t prefixFlags)
+{
+#ifdef FREIA_HAVE_IO_URING
+    if (ring) return fanOutIoUring(targets, count, data, prefixFlags);
+#endif
+    std::pmr::vector<int> failed(&frameArena);
+    for (size_t t = 0; t < count; ++t) {
+        if (!sendWithLengthPrefix(targets[t], data, prefixFlags)) failed.push_back(targets[t]);
+    }
+    return failed;
 }
 
-bool Server::sendWithLengthPrefix(int sock, const std::string& data)
+bool Server::sendWithLengthPrefix(int sock, std::string_view data, uint32_t prefixFlags)
 {
     if (sock <= 0) return false;
-    uint32_t lenNet = htonl(static_cast<uint32_t>(data.size()));
-    if (send(sock, &lenNet, sizeof(lenNet), 0) != sizeof(lenNet)) return false;
-    if (send(sock, data.data(), data.size(), 0) != static_cast<ssize_t>(data.size())) return false;
+    uint32_t lenNet = htonl(prefixFlags | static_cast<uint32_t>(data.size()));
+
+    // Behind a half sent backlog record or frames still waiting for room
+    if (hasPendingOutput(sock)) {
+        queueOutput(sock, std::string_view(reinterpret_cast<const char*>(&lenNet), sizeof(lenNet)), data);
+        return true;
+    }
+    tcpTuning.beforeWrite(sock);
+
+    // Prefix and payload in one call, with Nagle off two sends would be two segments.
+    // Whatever the socket has no room for waits in its outbox.
+    iovec parts[2] = {{&lenNet, sizeof(lenNet)}, {const_cast<char*>(data.data()), data.size()}};
+    msghdr msg{};
+    msg.msg_iov = parts;
+    msg.msg_iovlen = 2;
+    ssize_t sent = sendmsg(sock, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) return false;
+
+    std::string_view prefix(reinterpret_cast<const char*>(&lenNet), sizeof(lenNet));
+    size_t done = sent < 0 ? 0 : static_cast<size_t>(sent);
+    if (done < prefix.size()) queueOutput(sock, prefix.substr(done), data);
+    else if (done < prefix.size() + data.size()) queueOutput(sock, {}, data.substr(done - prefix.size()));
     return true;
 }
\ No newline at end of file
@@ -0,0 +1,484 @@
+#include "server.h"
+
+#ifdef FREIA_HAVE_IO_URING
+
+#include <algorithm>
+
+// user_data layout: [8 bit op][24 bit connection generation][32 bit fd]
+namespace {
+    enum RingOp : uint64_t { OP_ACCEPT = 1, OP_RECV, OP_SEND_PREFIX, OP_SEND_DATA, OP_CANCEL, OP_UPGRADE,
+                              OP_FEDERATION, OP_TIMEOUT, OP_WRITABLE, OP_FEDERATION_WRITABLE };
+
+    uint64_t ringTag(RingOp op, uint32_t generation, int fd)
+    {
+        return (static_cast<uint64_t>(op) << 56) |
+               (static_cast<uint64_t>(generation & 0xFFFFFF) << 32) |
+               static_cast<uint32_t>(fd);
+    }
+
+    RingOp tagOp(uint64_t tag) { return static_cast<RingOp>(tag >> 56); }
+    uint32_t tagGeneration(uint64_t tag) { return static_cast<uint32_t>(tag >> 32) & 0xFFFFFF; }
+    int tagFd(uint64_t tag) { return static_cast<int>(static_cast<uint32_t>(tag)); }
+
+    // Both halves of a linked send share it, see Server::ringSends
+    uint64_t ringSendKey(uint64_t tag) { return tag & ((uint64_t(1) << 56) - 1); }
+}
+
+// Returns false when io_uring can't be used, the caller falls back to select
+bool Server::runIoUring()
+{
+    ring = std::make_unique<IoUring>();
+    if (!ring->init(RING_ENTRIES) || !ring->registerBufferRing(0, RECV_BUFFER_COUNT, RECV_BUFFER_SIZE))
+    {
+        std::cout << "io_uring not available (errno=" << errno << "), falling back to select\n";
+        ring.reset();
+        return false;
+    }
+    std::cout << "Using io_uring backend\n";
+
+    armIoUringAccept();
+    if (upgradeSocket >= 0) ring->prepPoll(upgradeSocket, ringTag(OP_UPGRADE, 0, upgradeSocket));
+    for (int i = 0; i < maxClients; ++i) {
+        if (clientSocket[i] <= 0) continue;
+        ringConnections[clientSocket[i]].generation = ++nextRingGeneration;
+        armIoUringRecv(clientSocket[i]);
+    }
+    for (const auto& [fd, deadline] : handshakes) {
+        ringConnections[fd].generation = ++nextRingGeneration;
+        armIoUringRecv(fd);
+    }
+    // Input left incomplete by a hot restart continues in the inbox
+    for (auto& [fd, input] : inboxes) ringConnections[fd].inbox = std::move(input);
+    inboxes.clear();
+
+    uint64_t iterations = 0;
+    while (true)
+    {
+        // transient parsing data of the previous iteration is gone
+        frameArena.reset();
+        if (++iterations % STATS_INTERVAL == 0) logMemoryStats();
+
+        for (auto it = ringConnections.begin(); it != ringConnections.end();) {
+            if (!it->second.open) it = ringConnections.erase(it);
+            else ++it;
+        }
+
+        // Multishot recv ends on pauses and when the buffer ring runs dry, restart it here
+        for (auto& [fd, connection] : ringConnections) {
+            if (connection.recvArmed || fileRelay.isPaused(fd)) continue;
+            drainIoUringInbox(fd);
+            if (connection.open && !connection.recvArmed && !fileRelay.isPaused(fd))
+                armIoUringRecv(fd);
+        }
+
+        // Backlogs and queued frames go out whenever the socket has room
+        auto armWritable = [&](int fd) {
+            auto it = ringConnections.find(fd);
+            if (it == ringConnections.end() || !it->second.open || it->second.writablePollArmed ||
+                it->second.sendInFlight) return;
+            it->second.writablePollArmed =
+                ring->prepPoll(fd, ringTag(OP_WRITABLE, it->second.generation, fd), POLLOUT);
+        };
+        for (const auto& [fd, delivery] : backlogs) armWritable(fd);
+        for (const auto& [fd, outbox] : outboxes) armWritable(fd);
+
+        dropFailedSockets();
+        expireHandshakes();
+        pumpFederation();
+        if (federation.enabled()) armIoUringFederation();
+        if (time(nullptr) >= nextMaintenance) runMaintenance();
+        armIoUringTimer();
+        tcpTuning.flush();
+
+        if (ring->submit(1) < 0 && errno != EINTR)
+            handleSystemCallError("io_uring_enter failed");
+
+        // Completions reaped while quiescing for a failed hand-off are older than the ones still in the ring
+        while (true)
+        {
+            io_uring_cqe cqe;
+            if (!deferredCqes.empty()) {
+                cqe = deferredCqes.front();
+                deferredCqes.pop_front();
+            } else if (io_uring_cqe* next = ring->peekCqe()) {
+                cqe = *next;
+                ring->seenCqe();
+            } else {
+                break;
+            }
+            handleIoUringCompletion(cqe);
+            if (handedOff) return true;
+        }
+    }
+}
+
+void Server::handleIoUringCompletion(const io_uring_cqe& cqe)
+{
+    int fd = tagFd(cqe.user_data);
+
+    if (tagOp(cqe.user_data) == OP_UPGRADE)
+    {
+        handOff();
+        if (!handedOff) ring->prepPoll(upgradeSocket, ringTag(OP_UPGRADE, 0, upgradeSocket));
+        return;
+    }
+
+    if (tagOp(cqe.user_data) == OP_FEDERATION || tagOp(cqe.user_data) == OP_FEDERATION_WRITABLE)
+    {
+        bool readable = tagOp(cqe.user_data) == OP_FEDERATION;
+        auto& polls = readable ? federationPolls : federationWritePolls;
+        auto it = polls.find(fd);
+        if (it == polls.end() || (it->second & 0xFFFFFF) != tagGeneration(cqe.user_data)) return;
+        uint32_t id = it->second;
+        polls.erase(it);
+        if (cqe.res > 0) federation.handleReady(fd, id, readable, !readable);
+        return;
+    }
+
+    if (tagOp(cqe.user_data) == OP_TIMEOUT)
+    {
+        if (time(nullptr) >= loopTimerDeadline) loopTimerDeadline = 0;
+        return;
+    }
+
+    if (tagOp(cqe.user_data) == OP_WRITABLE)
+    {
+        auto it = ringConnections.find(fd);
+        if (it == ringConnections.end() || !it->second.open ||
+            it->second.generation != tagGeneration(cqe.user_data)) return;
+        it->second.writablePollArmed = false;
+        if (cqe.res > 0) handleWritable(fd);
+        return;
+    }
+
+    if (tagOp(cqe.user_data) == OP_SEND_PREFIX || tagOp(cqe.user_data) == OP_SEND_DATA)
+    {
+        finishIoUringSend(cqe);
+        return;
+    }
+
+    if (tagOp(cqe.user_data) == OP_ACCEPT)
+    {
+        if (!(cqe.flags & IORING_CQE_F_MORE)) armIoUringAccept();
+        if (cqe.res < 0) {
+            std::cerr << "accept failed (errno=" << -cqe.res << ")\n";
+            return;
+        }
+        acceptIoUringClient(cqe.res, true);
+        return;
+    }
+
+    if (tagOp(cqe.user_data) != OP_RECV) return;
+
+    auto it = ringConnections.find(fd);
+    bool current = it != ringConnections.end() && it->second.open &&
+                   it->second.generation == tagGeneration(cqe.user_data);
+
+    if (cqe.flags & IORING_CQE_F_BUFFER)
+    {
+        uint16_t bufferId = static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+        if (current && cqe.res > 0) it->second.inbox.append(ring->buffer(bufferId), cqe.res);
+        ring->recycleBuffer(bufferId);
+    }
+    if (!current) return;
+
+    if (!(cqe.flags & IORING_CQE_F_MORE)) {
+        it->second.recvArmed = false;
+        it->second.cancelRequested = false;
+    }
+
+    if (cqe.res == 0 || (cqe.res < 0 && cqe.res != -ENOBUFS && cqe.res != -ECANCELED))
+    {
+        int slot = -1;
+        for (int i = 0; i < maxClients; ++i) {
+            if (clientSocket[i] == fd) slot = i;
+        }
+        if (slot < 0) {
+            if (handshakes.count(fd)) dropHandshake(fd, "connection closed");
+            return;
+        }
+
+        getpeername(fd, (struct sockaddr*)&address, (socklen_t*)&addrlen);
+        std::cout << "Host disconnected! ip: " << ipOf(address)
+                  << " port: " << ntohs(address.sin_port) << "\n";
+        disconnectClient(slot, "Client Disconnected");
+        return;
+    }
+
+    drainIoUringInbox(fd);
+
+    // Less than a frame is left unless the sender is paused, a client piling up more is dropped
+    it = ringConnections.find(fd);
+    if (it != ringConnections.end() && it->second.open && it->second.inbox.size() > RING_READ_BYTES + maxFrameBytes())
+    {
+        for (int i = 0; i < maxClients; ++i) {
+            if (clientSocket[i] == fd) disconnectClient(i, "[Warning] Input buffer limit exceeded\n");
+        }
+    }
+}
+
+void Server::armIoUringAccept()
+{
+    ring->prepAcceptMultishot(masterSocket, ringTag(OP_ACCEPT, 0, masterSocket));
+}
+
+// The handshake is read by a recv like everything else, drainIoUringInbox runs it once it
+// is complete. Without armRecv the loop arms it later, see quiesceIoUring.
+void Server::acceptIoUringClient(int fd, bool armRecv)
+{
+    if (!admitClient(fd)) return;
+
+    IoUringConnection& connection = ringConnections[fd];
+    connection = IoUringConnection{};
+    connection.generation = ++nextRingGeneration;
+    if (armRecv) armIoUringRecv(fd);
+}
+
+void Server::armIoUringRecv(int fd)
+{
+    IoUringConnection& connection = ringConnections[fd];
+    if (ring->prepRecvMultishot(fd, ringTag(OP_RECV, connection.generation, fd)))
+        connection.recvArmed = true;
+}
+
+// Hands every complete frame in the inbox to the same handlers the select loop uses
+void Server::drainIoUringInbox(int fd)
+{
+    auto it = ringConnections.find(fd);
+    if (it == ringConnections.end() || !it->second.open) return;
+
+    std::string& inbox = it->second.inbox;
+    auto used = processInput(fd, inbox);
+    // A handler dropped the client, its connection is retired
+    if (!used) return;
+    inbox.erase(0, *used);
+
+    // Same as leaving the socket out of the select set: stop reading until receivers catch up
+    IoUringConnection& connection = it->second;
+    if (fileRelay.isPaused(fd) && connection.recvArmed && !connection.cancelRequested)
+    {
+        ring->prepCancel(ringTag(OP_RECV, connection.generation, fd), ringTag(OP_CANCEL, 0, fd));
+        connection.cancelRequested = true;
+    }
+}
+
+void Server::retireIoUringConnection(int fd)
+{
+    auto it = ringConnections.find(fd);
+    if (it == ringConnections.end()) return;
+
+    // The entry itself is erased at the top of the next loop iteration. A send still in flight
+    // holds on to the socket, its completion finds the connection gone and only frees the frame.
+    IoUringConnection& connection = it->second;
+    if (connection.recvArmed)
+        ring->prepCancel(ringTag(OP_RECV, connection.generation, fd), ringTag(OP_CANCEL, 0, fd));
+    if (connection.writablePollArmed)
+        ring->prepCancel(ringTag(OP_WRITABLE, connection.generation, fd), ringTag(OP_CANCEL, 0, fd));
+    if (connection.sendInFlight) {
+        ring->prepCancel(ringTag(OP_SEND_PREFIX, connection.generation, fd), ringTag(OP_CANCEL, 0, fd));
+        ring->prepCancel(ringTag(OP_SEND_DATA, connection.generation, fd), ringTag(OP_CANCEL, 0, fd));
+    }
+    if (connection.recvArmed || connection.writablePollArmed || connection.sendInFlight) ring->submit();
+    connection.open = false;
+    connection.recvArmed = false;
+    connection.writablePollArmed = false;
+    connection.sendInFlight = false;
+}
+
+// Peer links are polled once per readiness, for writing only while they connect or have unsent frames.
+// Polls of links that were closed in the meantime are cancelled, their fd may already be reused.
+void Server::armIoUringFederation()
+{
+    auto watched = federation.watchedSockets();
+    auto sync = [&](std::unordered_map<int, uint32_t>& polls, RingOp op, bool writing) {
+        for (auto it = polls.begin(); it != polls.end();)
+        {
+            auto [fd, id] = *it;
+            bool current = std::any_of(watched.begin(), watched.end(), [&](const auto& socket) {
+                return socket.fd == fd && socket.id == id && (!writing || socket.wantsWrite);
+            });
+            if (current) {
+                ++it;
+                continue;
+            }
+            ring->prepCancel(ringTag(op, id, fd), ringTag(OP_CANCEL, 0, fd));
+            it = polls.erase(it);
+        }
+
+        for (const auto& socket : watched) {
+            if ((writing && !socket.wantsWrite) || polls.count(socket.fd)) continue;
+            if (ring->prepPoll(socket.fd, ringTag(op, socket.id, socket.fd), writing ? POLLOUT : POLLIN))
+                polls[socket.fd] = socket.id;
+        }
+    };
+    sync(federationPolls, OP_FEDERATION, false);
+    sync(federationWritePolls, OP_FEDERATION_WRITABLE, true);
+}
+
+// Wakes the loop up for maintenance and to redial lost peers. A timeout that is already armed
+// stays, an earlier deadline just adds another one.
+void Server::armIoUringTimer()
+{
+    time_t now = time(nullptr);
+    time_t deadline = now + secondsUntilTimer();
+    if (loopTimerDeadline != 0 && loopTimerDeadline <= deadline) return;
+
+    loopTimer.tv_sec = deadline - now;
+    loopTimer.tv_nsec = 0;
+    if (ring->prepTimeout(&loopTimer, ringTag(OP_TIMEOUT, 0, 0))) loopTimerDeadline = deadline;
+}
+
+// Stops accept and every multishot recv before a hot restart and waits for the sends in flight,
+// what they did not get out is queued for the new process. Bytes that still come in are kept
+// in the inboxes and handed over, nothing is parsed anymore. Other completions are kept for
+// the loop, it goes on when the hand-off fails.
+void Server::quiesceIoUring()
+{
+    ring->prepCancel(ringTag(OP_ACCEPT, 0, masterSocket), ringTag(OP_CANCEL, 0, masterSocket));
+    bool acceptArmed = true;
+    for (auto& [fd, connection] : ringConnections) {
+        if (!connection.open || !connection.recvArmed || connection.cancelRequested) continue;
+        ring->prepCancel(ringTag(OP_RECV, connection.generation, fd), ringTag(OP_CANCEL, 0, fd));
+        connection.cancelRequested = true;
+    }
+    for (const auto& [key, send] : ringSends) {
+        ring->prepCancel(key | (uint64_t(OP_SEND_PREFIX) << 56), ringTag(OP_CANCEL, 0, 0));
+        ring->prepCancel(key | (uint64_t(OP_SEND_DATA) << 56), ringTag(OP_CANCEL, 0, 0));
+    }
+
+    auto anyArmed = [&]() {
+        if (acceptArmed || !ringSends.empty()) return true;
+        for (const auto& [fd, connection] : ringConnections) {
+            if (connection.open && connection.recvArmed) return true;
+        }
+        return false;
+    };
+
+    std::deque<io_uring_cqe> kept;
+    while (anyArmed())
+    {
+        io_uring_cqe cqe;
+        if (!deferredCqes.empty()) {
+            cqe = deferredCqes.front();
+            deferredCqes.pop_front();
+        } else if (io_uring_cqe* next = ring->peekCqe()) {
+            cqe = *next;
+            ring->seenCqe();
+        } else {
+            if (ring->submit(1) < 0 && errno != EINTR)
+                handleSystemCallError("io_uring_enter failed");
+            continue;
+        }
+
+        int fd = tagFd(cqe.user_data);
+        RingOp op = tagOp(cqe.user_data);
+        if (op == OP_ACCEPT) {
+            // Already accepted by the kernel, it is handed off with its handshake still to do
+            if (cqe.res >= 0) acceptIoUringClient(cqe.res, false);
+            if (!(cqe.flags & IORING_CQE_F_MORE)) acceptArmed = false;
+        } else if (op == OP_RECV) {
+            auto it = ringConnections.find(fd);
+            bool current = it != ringConnections.end() && it->second.open &&
+                           it->second.generation == tagGeneration(cqe.user_data);
+            if (cqe.flags & IORING_CQE_F_BUFFER) {
+                uint16_t bufferId = static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+                if (current && cqe.res > 0) it->second.inbox.append(ring->buffer(bufferId), cqe.res);
+                ring->recycleBuffer(bufferId);
+            }
+            if (current && !(cqe.flags & IORING_CQE_F_MORE)) {
+                it->second.recvArmed = false;
+                it->second.cancelRequested = false;
+            }
+        } else if (op == OP_SEND_PREFIX || op == OP_SEND_DATA) {
+            finishIoUringSend(cqe);
+        } else if (op != OP_CANCEL) {
+            kept.push_back(cqe);
+        }
+    }
+    // Older than whatever is still deferred
+    kept.insert(kept.end(), deferredCqes.begin(), deferredCqes.end());
+    deferredCqes.swap(kept);
+}
+
+// One linked prefix + payload send per target. They are submitted together and the loop goes on,
+// finishIoUringSend sees to their results. A target with a send still in flight or frames
+// queued gets the frame in its outbox, like a socket without room in select mode.
+std::pmr::vector<int> Server::fanOutIoUring(const int* targets, size_t count, std::string_view data, uint32_t prefixFlags)
+{
+    std::pmr::vector<int> failed(&frameArena);
+    uint32_t lengthNet = htonl(prefixFlags | static_cast<uint32_t>(data.size()));
+
+    std::shared_ptr<PooledBuffer> payload;
+    for (size_t t = 0; t < count; ++t)
+    {
+        int target = targets[t];
+        auto connection = ringConnections.find(target);
+        if (target <= 0 || connection == ringConnections.end() || !connection->second.open) {
+            failed.push_back(target);
+            continue;
+        }
+        // A payload in flight is charged like queued output, a bigger one is refused there
+        if (hasPendingOutput(target) || sizeof(lengthNet) + data.size() > outboxLimitBytes) {
+            queueOutput(target, std::string_view(reinterpret_cast<const char*>(&lengthNet), sizeof(lengthNet)), data);
+            continue;
+        }
+
+        // The caller's frame is gone when the sends complete, all targets share one copy
+        if (!payload) {
+            payload = std::make_shared<PooledBuffer>(framePool.acquire(data.size()));
+            std::memcpy(payload->data(), data.data(), data.size());
+        }
+        uint32_t generation = connection->second.generation;
+        RingSend& send = ringSends[ringSendKey(ringTag(OP_SEND_PREFIX, generation, target))];
+        send.payload = payload;
+        send.payloadLength = data.size();
+        send.prefixNet = lengthNet;
+
+        // A link must not be split over two submissions
+        if (ring->freeSqes() < 2) ring->submit();
+        tcpTuning.beforeWrite(target);
+        ring->prepSend(target, &send.prefixNet, sizeof(send.prefixNet), ringTag(OP_SEND_PREFIX, generation, target), true);
+        ring->prepSend(target, payload->data(), data.size(), ringTag(OP_SEND_DATA, generation, target), false);
+        connection->second.sendInFlight = true;
+    }
+    // Submitted right away, a socket closed later on must not be looked up by the kernel anymore
+    if (payload) ring->submit();
+    return failed;
+}
+
+// Both halves of a send are back: a failed socket is dropped by the loop, what a short or
+// cancelled send left over goes in front of the queued frames
+void Server::finishIoUringSend(const io_uring_cqe& cqe)
+{
+    auto it = ringSends.find(ringSendKey(cqe.user_data));
+    if (it == ringSends.end()) return;
+    RingSend& send = it->second;
+    (tagOp(cqe.user_data) == OP_SEND_PREFIX ? send.prefixResult : send.payloadResult) = cqe.res;
+    if (--send.outstanding > 0) return;
+
+    RingSend done = std::move(send);
+    ringSends.erase(it);
+
+    int fd = tagFd(cqe.user_data);
+    auto connection = ringConnections.find(fd);
+    if (connection == ringConnections.end() || !connection->second.open ||
+        connection->second.generation != tagGeneration(cqe.user_data)) return;
+    connection->second.sendInFlight = false;
+
+    // The payload half of a link whose prefix failed is cancelled by the kernel
+    auto broken = [](int res) { return res < 0 && res != -ECANCELED && res != -EINTR && res != -EAGAIN; };
+    if (broken(done.prefixResult) || broken(done.payloadResult)) {
+        failedSockets.push_back(fd);
+        return;
+    }
+
+    size_t prefixSent = std::max(done.prefixResult, 0);
+    size_t payloadSent = prefixSent == sizeof(done.prefixNet) ? std::max(done.payloadResult, 0) : 0;
+    if (prefixSent == sizeof(done.prefixNet) && payloadSent == done.payloadLength) return;
+
+    std::string_view prefix(reinterpret_cast<const char*>(&done.prefixNet), sizeof(done.prefixNet));
+    queueOutput(fd, prefix.substr(prefixSent),
+                std::string_view(done.payload->data(), done.payloadLength).substr(payloadSent), true);
+}
+
+#endif